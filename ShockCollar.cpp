@@ -8,7 +8,7 @@
 // Non-commercial personal use and modification of this work is permitted.
 // Do not distribute this or derived work without permission.
 //
-#include <Arduino.h>
+#include "ShockCollarHAL.h"
 #include "ShockCollar.h"
 
 #define COLLAR_KEEPALIVE 120000         // Frequency (ms) of keepalive messages
@@ -22,19 +22,38 @@
 #define S_ZERO		 750		//		space
 #define M_ONE		 750		// Long  (1),	mark
 #define S_ONE		 250		//		space
-#define IPG		7300		// Inter-packet gap (space)
-#define LEADIN				// Hack to inject extra start bits
+#define IPG		COLLAR_IPG	// Inter-packet gap (space)
+
+// The interrupt driven backend only exists on AVR
+//
+#if defined(COLLAR_TIMER) && !defined(__AVR__)
+#undef COLLAR_TIMER
+#endif
+#if defined(COLLAR_USART) && !(defined(__AVR__) && defined(UBRR1))
+#undef COLLAR_USART
+#endif
+#if defined(COLLAR_CAPTURE) && !(defined(__AVR__) && defined(ICR1))
+#undef COLLAR_CAPTURE
+#endif
+#if defined(COLLAR_SAMPLE) && !(defined(__AVR__) && defined(OCR1B))
+#undef COLLAR_SAMPLE
+#endif
+#if defined(COLLAR_PININT) || defined(COLLAR_CAPTURE) || defined(COLLAR_SAMPLE)
+#define COLLAR_RXQ			// Edge buffer, for any of them
+#endif
 
 //-- Set up collar output pins ------------------------------------------------
 //
 // Sets up the radio output and LED pins
 //
-void ShockCollar::begin(char pin, char led) {
+void CollarRadio::begin(char pin, char led) {
 	collar_pin = pin;
 	collar_led = led;
-	key = COLLAR_DEFAULT_KEY;	// Default
-        kchan = 0;
-	interrupt = 0;
+	mode = COLLAR_TX_BLOCK;
+	collars = rr = 0;
+	lead = COLLAR_LEADIN;
+	leadgap = 0;
+	warm = 0;
 	sclk = micros();
 	pinMode(pin, OUTPUT);		// Set transmitter pin as output
 	digitalWrite(pin, LOW);		// Turn off radio
@@ -44,6 +63,35 @@ void ShockCollar::begin(char pin, char led) {
 	}
 }
 
+// Set up a collar with its own radio ...
+//
+void ShockCollar::begin(char pin, char led) {
+	own.begin(pin, led);
+	begin(own);
+}
+
+// ... or sharing one with other collars. Each collar is registered with the
+// radio, so its service() can run them all.
+//
+void SharedCollar::begin(CollarRadio &r) {
+	SharedCollar *c;
+
+	radio = &r;
+	for(c = r.collars; c && c != this; c = c->next)
+		;
+	if(!c) {			// Register (once)
+		next = r.collars;
+		r.collars = this;
+	}
+	key = COLLAR_DEFAULT_KEY;	// Default
+        kchan = 0;
+	interrupt = 0;
+	cstate = COLLAR_IDLE;
+	cpkt[0][0] = cpkt[1][0] = 0;	// Empty render cache
+	cwave[0].len = cwave[1].len = 0;
+	cnext = 0;
+}
+
 //-- Construct a command packet------------------------------------------------
 // Returns 1 if packet buffer formats correctly, 0 otherwise
 // pkt	= buffer to place packet in. 
@@ -76,7 +124,7 @@ void ShockCollar::begin(char pin, char led) {
 //	Hex	     8	   1   | a   b	 |c   d   | 6	4   | 7    e	|0
 //	Fields: l=Lead-in c=Chan m=Mode k=Key p=Power M=ModeX C=ChanX t=Trailer
 //
-int ShockCollar::packet(collar_pkt &pkt,
+int SharedCollar::packet(collar_pkt &pkt,
 			collar_key key, char chan, collar_cmd cmd, char pwr) {
 	unsigned char h, t;	// pkt[0] and pkt[4] values
 
@@ -113,6 +161,36 @@ int ShockCollar::packet(collar_pkt &pkt,
 }
 
 
+//-- Render a packet ----------------------------------------------------------
+//
+// Turn a packet into a table of pulses, so the transmitters can replay it
+// with no per-bit work. Each pulse is one byte, mark << 4 | space, in 250us
+// units (every mark and space is a multiple of that). The table covers the
+// start flag, 40 data bits and the 2nd trailer bit, and ipg is added to the
+// last space. (Any lead-in is up to the radio; it's just more start flags.)
+// Returns 1 if OK, 0 (and an empty table) if the packet's invalid.
+//
+#define PULSE(m, s)	((m) / 250 << 4 | (s) / 250)
+static_assert(PULSE(M_FLAG, S_FLAG) == COLLAR_P_FLAG &&
+	      PULSE(M_ZERO, S_ZERO) == COLLAR_P_ZERO &&
+	      PULSE(M_ONE,  S_ONE)  == COLLAR_P_ONE, "Pulse codes mismatch");
+
+int SharedCollar::render(collar_wave &w, collar_pkt &pkt) {
+	char bit;
+
+	w.len = 0;
+	if(!(pkt[0] & 0x80)) return 0;			// Ignore invalid
+	w.ipg = IPG;
+	w.pulse[0] = PULSE(M_FLAG, S_FLAG);		// Start flag
+	for(bit = 0; bit < 40; bit++)			// High-order bit first
+		w.pulse[bit + 1] = (pkt[bit >> 3] >> (7 - (bit & 7))) & 1 ?
+				PULSE(M_ONE, S_ONE) : PULSE(M_ZERO, S_ZERO);
+	w.pulse[41] = PULSE(M_ZERO, S_ZERO);		// 2nd trailer bit
+	w.len = COLLAR_PULSES;
+	return 1;
+}
+
+
 //-- Send a packet to the collar ----------------------------------------------
 //
 // First, a routine to send a pulse of arbitrary length and spacing
@@ -125,93 +203,584 @@ int ShockCollar::packet(collar_pkt &pkt,
 // off delay for the trailer bit.
 // Note that this code blocks during packet transmission.
 //
-void ShockCollar::sendpulse(int on, int off) {
+void CollarRadio::sendpulse(int on, int off) {
 	long t = sclk - micros();
 	if(t > 0) delayMicroseconds(t);
 	digitalWrite(collar_pin, HIGH);
+	collar_trace(COLLAR_TRACE_TX | collar_pin, HIGH, micros());
 	delayMicroseconds(on - 5);
 	digitalWrite(collar_pin, LOW);
+	collar_trace(COLLAR_TRACE_TX | collar_pin, LOW, micros());
 	sclk += on + off;
 }
 
-// And the actual function.
-// pkt	= pointer to packet buffer formatted by packet().
+// Activity LED on/off
+//
+void CollarRadio::blink(char on) {
+	if(collar_led < 0) return;
+	digitalWrite(collar_led, on);
+	collar_trace(COLLAR_TRACE_LED | collar_led, on, micros());
+}
+
+// Carrier on/off
+//
+void CollarRadio::carrier(char on) {
+	digitalWrite(collar_pin, on);
+	collar_trace(COLLAR_TRACE_TX | collar_pin, on, micros());
+}
+
+//-- Lead-in ------------------------------------------------------------------
+//
+// Receivers (the collars', and the modules sold with the transmitters) don't
+// lock on to the signal until it's been there for a while, longer than a
+// start flag, so after a gap we send some extra start flags to wake them up.
+// The number of flags, and how long the radio has to have been idle before
+// they're needed, can be set. (Consecutive packets never get them.) There
+// can be at most COLLAR_MAXLEAD flags: that's all the USART's stream has
+// room for, and the Timer1 engine counts them in a char.
+// flags = extra start flags (each 2.25ms), up to COLLAR_MAXLEAD
+// gap	 = idle time (us) after the IPG before they're needed
+//
+void CollarRadio::leadin(unsigned char flags, unsigned long gap) {
+	lead = flags < COLLAR_MAXLEAD ? flags : COLLAR_MAXLEAD;
+	leadgap = gap;
+}
+
+// Alternatively, start the carrier early, while the application is still
+// working out what to send, and the next packet will follow it without any
+// lead-in (once the carrier has been on for at least a flag's mark). Does
+// nothing if the radio's busy, or (with the blocking transmitter) still in
+// the last packet's IPG, as the carrier would cut the gap short; there's no
+// lead-in to save then anyway. Don't leave it on for long; something should
+// be sent straight after.
 //
-void ShockCollar::send(collar_pkt &pkt) {
-	char bit;	// Bit counter
+void CollarRadio::prewarm() {
+	unsigned long t = sclk - micros();	// Time left of the IPG
+
+	if(busy() || warm || (t && t <= IPG + S_ZERO)) return;
+	carrier(HIGH);
+	warmt = micros();
+	warm = 1;
+}
+
+// Number of lead-in flags after being idle since t
+//
+unsigned char CollarRadio::leadflags(unsigned long t) {
+	return micros() - t >= leadgap ? lead : 0;
+}
+
+// Send a rendered packet.
+// All the collars using the radio send through here, so they share the one
+// clock: consecutive packets, from whichever collar, go out back to back
+// with the proper IPG and without the lead-in flags.
+// w	= pulse table from render().
+//
+void CollarRadio::send(collar_wave &w) {
+	unsigned char i, n, p;
 	unsigned long t;
 
-	// If the clock isn't within an IPG (plus the length of the
-	// previous closing stop bit), reset it. This will also detect
-	// a gap between packets. If we're sending extra leading flags
-	// to give receivers a chance to lock, send them now.
+	if(!w.len) return;				// Ignore invalid
+#ifdef COLLAR_TIMER
+	if(mode == COLLAR_TX_TIMER) {			// Hand it to the ISR
+		txqueue(w);
+		return;
+	}
+#endif
+#ifdef COLLAR_USART
+	if(mode == COLLAR_TX_USART) {			// Or to the USART
+		usqueue(w);
+		return;
+	}
+#endif
+
+	// If the carrier's been pre-warmed, finish it off as a flag mark
+	// and carry on with the packet. Otherwise, if the clock isn't within
+	// an IPG (plus the length of the previous closing stop bit), reset
+	// it. This will also detect a gap between packets. If we're sending
+	// extra leading flags to give receivers a chance to lock, send them
+	// now.
 	//
-	if(!pkt || !(pkt[0] & 0x80)) return;		// Ignore invalid
 	t = micros();
-	if(sclk - t > IPG + S_ZERO) {
+	if(warm) {
+		if((long)(warmt + M_FLAG - t) > 0)
+			delayMicroseconds(warmt + M_FLAG - t);
+		carrier(LOW);
+		warm = 0;
+		sclk = micros() + S_FLAG;
+	}
+	else if(sclk - t > IPG + S_ZERO) {
+		n = leadflags(sclk);
 		sclk = t;
-#ifdef LEADIN
-		sendpulse(M_FLAG, S_FLAG);		// Extra start flags to
-		sendpulse(M_FLAG, S_FLAG);		// wake the receiver up
-#endif
+		p = w.pulse[0];
+		for(i = 0; i < n; i++)			// Extra start flags to
+			sendpulse((p >> 4) * 250, (p & 0xf) * 250); // wake up
+	}
+
+	// Send the packet (with the indicator LED lit after the flag)
+	//
+	for(i = 0; i < w.len; i++) {
+		p = w.pulse[i];
+		sendpulse((p >> 4) * 250, (p & 0xf) * 250);
+		if(i == 0) blink(HIGH);			// Blinkenlight
+	}
+	blink(LOW);					// Unblinkenlight
+	sclk += w.ipg;					// Advance clock to IPG
+}
+
+// Send a packet rendered at compile time (see CollarPacket in ShockCollar.h).
+// It's copied out of flash first, so the backends don't need to care.
+// w	= pointer to pulse table in PROGMEM.
+//
+void SharedCollar::send_P(const collar_wave *w) {
+	collar_wave t;
+
+	memcpy_P(&t, w, sizeof(t));
+	send(t);
+}
+
+// And the same for a raw packet. The last two packets rendered are cached,
+// since command() sends the same one or two packets over and over.
+// pkt	= pointer to packet buffer formatted by packet().
+//
+void SharedCollar::send(collar_pkt &pkt) {
+	char i;
+
+	for(i = 0; i < 2; i++)
+		if(!memcmp(cpkt[i], pkt, sizeof(collar_pkt)))
+			break;
+	if(i == 2) {					// Not cached
+		i = cnext;
+		cnext ^= 1;
+		memcpy(cpkt[i], pkt, sizeof(collar_pkt));
+		render(cwave[i], pkt);
+	}
+	send(cwave[i]);
+}
+
+
+//-- Interrupt driven transmitter ---------------------------------------------
+//
+// Timer1 free-runs at clk/8 and the compare A interrupt replays the pulse
+// table at the head of a small queue, setting each edge and scheduling the
+// next one by advancing OCR1A. Each edge is timed from the previous compare
+// value rather than from when the ISR ran, so latency doesn't accumulate
+// (it's the same idea as the sclk lock-step above). send() just queues the
+// packet and returns; it only waits if the queue is full.
+//
+// The engine is shared by all radios, so each queued packet carries its own
+// data and LED port/bit. Pulses are numbered -lead .. -1 for the wake-up
+// flags (repeats of pulse 0), then 0 .. len-1. A pre-warmed carrier becomes
+// pulse -1, already under way.
+//
+#ifdef COLLAR_TIMER
+#define TXQ		2		// Queue depth (power of 2)
+#define TICKS(us)	((us) * (F_CPU / 8000000L))	// Timer ticks
+
+static struct txent {
+	collar_wave w;			// Packet to send
+	volatile unsigned char *out;	// Data port & bit
+	volatile unsigned char *lout;	// LED port & bit (0 if none)
+	unsigned char omask, lmask;
+} txq[TXQ];
+static volatile unsigned char txhead, txtail;	// Queue in/out counters
+static volatile char txpulse;			// Current pulse number
+static volatile char txmark;			// Pin high?
+static volatile char txbusy;			// Engine running?
+static unsigned long txidle;			// When it went idle
+
+ISR(TIMER1_COMPA_vect) {
+	struct txent *e = &txq[txtail & (TXQ - 1)];
+	char n = txpulse;
+	unsigned int d;
+
+	// End of a mark. Drop the pin and time the space. The LED is lit
+	// after the start flag (as for send()), and the last space is
+	// stretched by the IPG.
+	//
+	if(txmark) {
+		*e->out &= ~e->omask;
+		txmark = 0;
+		d = (e->w.pulse[n < 0 ? 0 : n] & 0xf) * 250;
+		if(n == 0 && e->lout) *e->lout |= e->lmask;
+		if(n == e->w.len - 1) {
+			if(e->lout) *e->lout &= ~e->lmask;
+			d += e->w.ipg;
+		}
+		txpulse = n + 1;
+		OCR1A += TICKS(d);
+		return;
+	}
+
+	// End of a space. If the packet (and its IPG) is done, move on to
+	// the next one, back to back with no lead-in, or go idle.
+	//
+	if(n >= e->w.len) {
+		if(++txtail == txhead) {
+			TIMSK1 &= ~(1 << OCIE1A);
+			txbusy = 0;
+			txidle = micros();
+			return;
+		}
+		e = &txq[txtail & (TXQ - 1)];
+		n = 0;
 	}
 
-	// Send the packet (with the indicator LED lit)
+	// Start the next mark
 	//
-	sendpulse(M_FLAG, S_FLAG);			// Long start pulse
-	if(collar_led >= 0) digitalWrite(collar_led, HIGH); // Blinkenlight
-	for(bit = 0; bit < 40; bit++)			// 40 data bits
-		if((pkt[bit >> 3] >> (7 - (bit & 7))) & 1)
-			sendpulse(M_ONE,  S_ONE);	// High-order  bitfirst
-		else	sendpulse(M_ZERO, S_ZERO);
-	sendpulse(M_ZERO, S_ZERO);			// Send 2nd trailer bit
-	if(collar_led >= 0) digitalWrite(collar_led, LOW); // Unblinkenlight
-	sclk += IPG;					// Advance clock to IPG
+	*e->out |= e->omask;
+	txmark = 1;
+	d = (e->w.pulse[n < 0 ? 0 : n] >> 4) * 250;
+	txpulse = n;
+	OCR1A += TICKS(d);
+}
+
+// Queue a packet, waiting for room if need be, and kick the engine if it's
+// idle. An idle engine has seen a gap, so the packet may need its lead-in.
+//
+void CollarRadio::txqueue(collar_wave &w) {
+	unsigned long t;
+
+	while((unsigned char)(txhead - txtail) >= TXQ)	// Wait for room
+		;
+	struct txent *e = &txq[txhead & (TXQ - 1)];
+	e->w = w;
+	e->out = out;  e->omask = omask;
+	e->lout = lout; e->lmask = lmask;
+	noInterrupts();
+	txhead++;
+	if(!txbusy) {
+		txbusy = 1;
+		if(warm) {			// Carrier's on: finish the mark
+			t = micros() - warmt;
+			txpulse = -1;
+			txmark = 1;
+			warm = 0;
+			OCR1A = TCNT1 + TICKS(t < M_FLAG - 20 ? M_FLAG - t : 20);
+		}
+		else {
+			txpulse = -leadflags(txidle);
+			txmark = 0;
+			OCR1A = TCNT1 + TICKS(20);	// Off we go
+		}
+		TIFR1 = 1 << OCF1A;
+		TIMSK1 |= 1 << OCIE1A;
+	}
+	interrupts();
+}
+#endif
+
+//-- USART bitstream transmitter ----------------------------------------------
+//
+// Every mark and space is a multiple of 250us, so a packet can be rendered
+// as a 4 kbit/s bitstream and shifted out of USART1 in SPI master mode
+// (MSPIM), which can be clocked that slowly (the SPI port itself can't go
+// below clk/128). The data-register-empty interrupt feeds it a byte at a
+// time, and the edges are timed by the hardware, so there's no jitter.
+//
+// The pulse table is expanded into slots, one bit each. The lead-in flags
+// come first, padded at the front with idle slots to a byte boundary so
+// they can be skipped if the packet follows another back to back. There's
+// always at least one: after a pre-warmed carrier we start with the last
+// byte of it, which is the end of its mark and its space. The end
+// of the packet is padded with zeros to cover the IPG (rounded up to the
+// next byte). When the stream runs dry, the transmit complete interrupt
+// turns the transmitter off, giving the pin back to the port latch, so
+// that must be low (prewarm() sets it high; usqueue() clears it once the
+// USART has taken the pin over, so the warm-up mark isn't broken).
+//
+// The radio must be on the TXD1 pin (PD3, pin 1 on a Leonardo / Pro Micro,
+// 18 on a Mega), and XCK1 (PD5, the TX LED on a Pro Micro) is driven as the
+// shift clock.
+//
+#ifdef COLLAR_USART
+#ifndef TXQ
+#define TXQ		2		// Queue depth (power of 2)
+#endif
+#define US_LEN		32		// Stream bytes (up to COLLAR_MAXLEAD flags)
+
+static struct usent {
+	unsigned char buf[US_LEN];	// Rendered stream
+	unsigned char lead;		// Start with lead-in
+	unsigned char start, end;	// Packet start (after lead-in) & end
+	volatile unsigned char *lout;	// LED port & bit (0 if none)
+	unsigned char lmask;
+} usq[TXQ];
+static volatile unsigned char ushead, ustail;	// Queue in/out counters
+static volatile unsigned char uspos;		// Next byte to send
+static volatile char usbusy;			// Engine running?
+static unsigned long usidle;			// When it went idle
+
+// Expand a pulse table into a stream. Slots are packed high-order bit
+// first.
+//
+static void usput(unsigned char *buf, int &slot, unsigned char p) {
+	char on;
+	for(on = p >> 4; on > 0; on--, slot++)
+		buf[slot >> 3] |= 0x80 >> (slot & 7);
+	slot += p & 0xf;
+}
+
+static void usrender(struct usent *e, collar_wave &w, unsigned char lead) {
+	unsigned char n = lead ? lead : 1;
+	unsigned char i;
+	int slot;
+
+	for(i = 0; i < US_LEN; i++)
+		e->buf[i] = 0;
+	slot = (8 - n * 9 % 8) % 8;			// Align the lead-in
+	for(i = 0; i < n; i++)				// to end on a byte
+		usput(e->buf, slot, w.pulse[0]);
+	e->start = slot >> 3;
+	e->lead = lead ? 0 : e->start;
+	for(i = 0; i < w.len; i++)
+		usput(e->buf, slot, w.pulse[i]);
+	slot += w.ipg / 250 + 7;			// IPG, rounded up
+	e->end = slot >> 3 < US_LEN ? slot >> 3 : US_LEN;
+}
+
+// Feed the USART. At the end of a stream, carry straight on with the next
+// one (skipping its lead-in), or wait for the last byte to shift out.
+//
+ISR(USART1_UDRE_vect) {
+	struct usent *e = &usq[ustail & (TXQ - 1)];
+	unsigned char p = uspos;
+
+	if(p == e->start && e->lout) *e->lout |= e->lmask;
+	UDR1 = e->buf[p++];
+	if(p == e->end) {
+		if(e->lout) *e->lout &= ~e->lmask;
+		if(++ustail == ushead) {
+			UCSR1B = (1 << TXEN1) | (1 << TXCIE1);
+			return;
+		}
+		p = usq[ustail & (TXQ - 1)].start;
+	}
+	uspos = p;
+}
+
+ISR(USART1_TX_vect) {
+	UCSR1B = 0;			// Transmitter off, pin to port latch
+	UBRR1 = 0;
+	usbusy = 0;
+	usidle = micros();
+}
+
+// Queue a packet, waiting for room if need be, and start the USART if it's
+// idle.
+//
+void CollarRadio::usqueue(collar_wave &w) {
+	while((unsigned char)(ushead - ustail) >= TXQ)	// Wait for room
+		;
+	struct usent *e = &usq[ushead & (TXQ - 1)];
+	usrender(e, w, lead);
+	e->lout = lout;
+	e->lmask = lmask;
+	noInterrupts();
+	ushead++;
+	if(!usbusy) {
+		if(warm)			// End of the warm-up flag
+			uspos = e->start - 1;
+		else	uspos = leadflags(usidle) ? e->lead : e->start;
+		warm = 0;
+		usbusy = 1;
+		UCSR1A = 1 << TXC1;		// Clear stale completion
+		UCSR1C = (1 << UMSEL11) | (1 << UMSEL10);  // MSPIM, MSB 1st
+		UCSR1B = (1 << TXEN1) | (1 << UDRIE1);
+		UBRR1 = F_CPU / (2 * 4000L) - 1;	// 4 kbit/s
+		PORTD &= ~(1 << 3);		// Latch low (see above)
+	}
+	else if(!(UCSR1B & (1 << UDRIE1))) {	// Still in the last IPG,
+		uspos = e->start;		// so carry on back to back
+		UCSR1B = (1 << TXEN1) | (1 << UDRIE1);
+	}
+	interrupts();
+}
+#endif
+
+//-- Transmitter control ------------------------------------------------------
+//
+// Select the transmitter backend. Waits for anything queued to go first.
+// Returns 1 if OK, 0 if the backend isn't available.
+//
+int CollarRadio::txmode(collar_tx m) {
+	flush();
+	switch(m) {
+	case COLLAR_TX_BLOCK:
+		break;
+#ifdef COLLAR_TIMER
+	case COLLAR_TX_TIMER:
+		out   = portOutputRegister(digitalPinToPort(collar_pin));
+		omask = digitalPinToBitMask(collar_pin);
+		lout  = 0;
+		if(collar_led >= 0) {
+			lout  = portOutputRegister(digitalPinToPort(collar_led));
+			lmask = digitalPinToBitMask(collar_led);
+		}
+		TCCR1A = 0;			// Normal mode, clk/8
+		TCCR1B = (TCCR1B & (1 << ICNC1 | 1 << ICES1)) | 1 << CS11;
+		break;
+#endif
+#ifdef COLLAR_USART
+	case COLLAR_TX_USART:
+		if(digitalPinToPort(collar_pin) != PD		// TXD1 only
+		|| digitalPinToBitMask(collar_pin) != 1 << 3)
+			return 0;
+		lout  = 0;
+		if(collar_led >= 0) {
+			lout  = portOutputRegister(digitalPinToPort(collar_led));
+			lmask = digitalPinToBitMask(collar_led);
+		}
+		DDRD |= 1 << 5;			// XCK1 is the shift clock
+		break;
+#endif
+	default:
+		return 0;
+	}
+	mode = m;
+	return 1;
+}
+
+// Anything still to go out?
+//
+char CollarRadio::busy() {
+#ifdef COLLAR_TIMER
+	if(mode == COLLAR_TX_TIMER)
+		return txhead != txtail;
+#endif
+#ifdef COLLAR_USART
+	if(mode == COLLAR_TX_USART)
+		return usbusy;
+#endif
+	return 0;
+}
+
+// Is the queue full? (i.e. would send() block?) The blocking transmitter's
+// never full; it just blocks.
+//
+char CollarRadio::full() {
+#ifdef COLLAR_TIMER
+	if(mode == COLLAR_TX_TIMER)
+		return (unsigned char)(txhead - txtail) >= TXQ;
+#endif
+#ifdef COLLAR_USART
+	if(mode == COLLAR_TX_USART)
+		return (unsigned char)(ushead - ustail) >= TXQ;
+#endif
+	return 0;
+}
+
+// Wait for the transmitter to finish
+//
+void CollarRadio::flush() {
+	while(busy())
+		;
 }
 
 
 //-- Execute a collar command -------------------------------------------------
 //
-// Transmit commands to collar for a period. 
+// Transmit commands to collar for a period, without blocking. Start the
+// command with begin_command(), then call service() regularly until it
+// returns 0. Each call sends at most one packet (with the blocking
+// transmitter), or just queues the next packet if there's room (with a
+// background transmitter), so the caller can get on with other things in
+// between. cancel() stops the command.
 // key	= transmitter ID key
 // chan = channel (1, 2, or 3 for both channels)
 // cmd  = command (1..4)
 // pwr	= power level (0..100)
-// durn = Duration in ms, or negative packet count
-// intr = function to call to check if function should be interrupted
-//	  Note that intr() is only called about once every 50ms, i.e.
-//	  between transmitted packets.
-// Return 0 on error, 1 on success, 2 if interrupted.
+// durn = Duration in ms, or negative packet count (per channel)
+// Returns 0 on error (nothing started), 1 if OK.
 //
-int ShockCollar::command(collar_cmd cmd, char chan, char pwr, long durn) {
-	unsigned long t = millis();
-	collar_pkt pkt1, pkt2;
-
-	// Construct packet(s)
-	//
-	if(chan & 1) if(!packet(pkt1, key, 1, cmd, pwr)) return 0;
-	if(chan & 2) if(!packet(pkt2, key, 2, cmd, pwr)) return 0;
-	for(;;) {
-		// Check for interruptions, or completion of time limit
-		// or packet count
-		//
-		if(interrupt) if(interrupt()) return 2;
-		if((durn >= 0 && millis() - t >= durn) ||
-		   (durn  < 0 && durn++ >= 0))
-			return 1;
+int SharedCollar::begin_command(collar_cmd cmd, char chan, char pwr,
+								long durn) {
+	cstate = COLLAR_IDLE;
+	if(chan & 1) if(!packet(cmdpkt[0], key, 1, cmd, pwr)) return 0;
+	if(chan & 2) if(!packet(cmdpkt[1], key, 2, cmd, pwr)) return 0;
+	if(!(chan & 3)) return 0;
+	cchan  = chan;
+	cdurn  = durn;
+	cstep  = 0;
+	ctime  = millis();
+	cstate = COLLAR_RUNNING;
+	return 1;
+}
 
-		// Send packets
-		//
-		if(chan & 1) send(pkt1);
-		if(chan & 2) send(pkt2);
-	}
+// Returns 1 while the command is running, 0 when it's done (or there
+// isn't one).
+//
+char SharedCollar::service() {
+	if(cstate != COLLAR_RUNNING) return 0;
 
+	// At the start of each round of packets, check for completion of the
+	// time limit or packet count.
 	// If we're hitting the same channel(s) as the keepalive, reset the
 	// keepalive timer, since we've already just bumped the collar and
 	// we won't need to do it again for a bit.
 	//
-	if(chan == kchan)
-		lastkeepalive = millis();
+	if(!cstep) {
+		if((cdurn >= 0 && (long)(millis() - ctime) >= cdurn) ||
+		   (cdurn  < 0 && cdurn++ >= 0)) {
+			cstate = COLLAR_DONE;
+			if(cchan == kchan)
+				lastkeepalive = millis();
+			return 0;
+		}
+		cstep = cchan & 1 ? 1 : 2;
+	}
+
+	// Send the next packet, unless the transmitter's queue is full
+	//
+	if(full()) return 1;
+	send(cmdpkt[cstep - 1]);
+	cstep = (cstep == 1 && (cchan & 2)) ? 2 : 0;
+	return 1;
+}
+
+void SharedCollar::cancel() {
+	if(cstate == COLLAR_RUNNING)
+		cstate = COLLAR_CANCELLED;
+}
+
+// And the blocking version, built on the above.
+// interrupt() is called, if set, to check if the command should be
+// interrupted. Note that with the blocking transmitter this is only about
+// once every 50ms, i.e. between transmitted packets.
+// Return 0 on error, 1 on success, 2 if interrupted.
+//
+int SharedCollar::command(collar_cmd cmd, char chan, char pwr, long durn) {
+	if(!begin_command(cmd, chan, pwr, durn)) return 0;
+	for(;;) {
+		if(interrupt) if(interrupt()) {
+			cancel();
+			return 2;
+		}
+		if(!service())
+			return 1;
+	}
+}
+
+
+//-- Run the collars on a radio -----------------------------------------------
+//
+// Services the commands (see begin_command()) of all the collars registered
+// with the radio, taking turns a packet at a time, so several collars can be
+// run at once from the one transmitter.
+// Returns 1 while any are running, 0 when they're all done.
+//
+char CollarRadio::service() {
+	SharedCollar *c, *start;
+
+	if(!collars) return 0;
+	start = c = rr ? rr : collars;
+	do {
+		if(c->service()) {		// Sent (or queued) a packet
+			rr = c->next;
+			return 1;
+		}
+		c = c->next ? c->next : collars;	// Round and round
+	} while(c != start);
+	return 0;
 }
 
 
@@ -220,28 +789,557 @@ int ShockCollar::command(collar_cmd cmd, char chan, char pwr, long durn) {
 // Check if the keepalive period has expired. If it has, send three
 // quick LED commands to keep the collar from going to sleep. If channel 
 // specified, do for just that channel; if channel is 3, do both.
+// Nothing is sent while a command is running; the collar's awake anyway.
 // key	= transmitter ID key
 // chan = 0: do not keepalive; 1,2: keep <chan> alive; 3: keep both
 //
-void ShockCollar::keepalive() {
-	if(!kchan || millis() - lastkeepalive < COLLAR_KEEPALIVE)
+void SharedCollar::keepalive() {
+	if(!kchan || cstate == COLLAR_RUNNING
+		  || millis() - lastkeepalive < COLLAR_KEEPALIVE)
 		return;
 	command(COLLAR_LED, kchan, 50, -3);
 	lastkeepalive = millis();
 }
 
+// Time (ms) until keepalive() will next send something, 0 if it would now,
+// so a caller with nothing else to do can sleep until then. A command that's
+// running holds it off (and may put it back, if it's on the same channels).
+// Returns ~0UL if there's no keepalive channel.
+//
+unsigned long SharedCollar::keepalive_due() {
+	unsigned long t = millis() - lastkeepalive;
+
+	if(!kchan) return ~0UL;
+	return t < COLLAR_KEEPALIVE ? COLLAR_KEEPALIVE - t : 0;
+}
+
+
+//== Packet scheduler =========================================================
+//
+// Each stream needs a packet at least every <deadline> ms, and a packet takes
+// COLLAR_AIRTIME ms on the air, so the deadline is worth so many packet
+// "slots". That's rounded down to a power of two; a set of streams with
+// power-of-two periods can always be interleaved as long as the fractions
+// of the airtime they need add up to no more than one, so that's the test
+// for whether a new stream fits. (At the default 120ms, two streams fit;
+// relax the deadline to fit more.)
+//
+// Packets are sent earliest-deadline-first, as fast as the radio takes them.
+// They're rendered as they're sent rather than cached, to keep the streams
+// small.
+//
+static_assert((M_FLAG + S_FLAG + 41000L + IPG + 999) / 1000 <= COLLAR_AIRTIME,
+						"COLLAR_AIRTIME too short");
+
+void CollarScheduler::begin(CollarRadio &r) {
+	radio = &r;
+	misses = 0;
+	clear();
+}
+
+void CollarScheduler::clear() {
+	char i;
+	for(i = 0; i < COLLAR_STREAMS; i++)
+		stream[i].pkt[0] = 0;
+}
+
+// Deadline in slots (a power of two), or 0 if less than one
+//
+static unsigned char slots(unsigned int deadline) {
+	unsigned char n;
+
+	if(deadline < COLLAR_AIRTIME) return 0;
+	for(n = 1; n <= deadline / COLLAR_AIRTIME / 2 && n < 128; n <<= 1)
+		;
+	return n;
+}
+
+// Airtime needed by a stream with the given deadline, in 1/1024ths (more
+// than 1024 if it can't be done at all)
+//
+int CollarScheduler::cost(unsigned int deadline) {
+	unsigned char n = slots(deadline);
+	return n ? 1024 / n : 1025;
+}
+
+// Total airtime needed by the streams (bar one), in 1/1024ths
+//
+int CollarScheduler::density(int except) {
+	int d = 0;
+	char i;
+
+	for(i = 0; i < COLLAR_STREAMS; i++)
+		if(stream[i].pkt[0] && i != except)
+			d += 1024 / stream[i].slots;
+	return d;
+}
+
+// Add a stream.
+// Returns the stream number (for remove()), or -1 if the packet's invalid,
+// there's no room, or the stream wouldn't fit in the airtime left.
+//
+int CollarScheduler::add(collar_key key, char chan, collar_cmd cmd, char pwr,
+							unsigned int deadline) {
+	collar_stream *s;
+	int i, j = -1;
+
+	for(i = 0; i < COLLAR_STREAMS; i++)		// Free slot?
+		if(!stream[i].pkt[0] && j < 0) j = i;
+	if(j < 0) return -1;
+	s = &stream[j];
+	if(density(-1) + cost(deadline) > 1024
+	|| !SharedCollar::packet(s->pkt, key, chan, cmd, pwr)) {
+		s->pkt[0] = 0;
+		return -1;
+	}
+	s->slots = slots(deadline);
+	s->deadline = deadline;
+	s->last = millis() - deadline;			// Due now
+	return j;
+}
+
+void CollarScheduler::remove(int id) {
+	if(id >= 0 && id < COLLAR_STREAMS)
+		stream[id].pkt[0] = 0;
+}
+
+// Send the packet with the earliest deadline, if the radio has room.
+// Call this regularly. Returns the number of active streams.
+//
+char CollarScheduler::service() {
+	collar_stream *s = 0;
+	collar_wave w;
+	unsigned long t = millis();
+	long due, best = 0;
+	char i, n = 0;
+
+	for(i = 0; i < COLLAR_STREAMS; i++) {
+		if(!stream[i].pkt[0]) continue;
+		n++;
+		due = stream[i].last + stream[i].deadline - t;
+		if(!s || due < best) {
+			s = &stream[i];
+			best = due;
+		}
+	}
+	if(!s || radio->full()) return n;
+	if(best < 0) misses++;
+	SharedCollar::render(w, s->pkt);
+	radio->send(w);
+	s->last = t;
+	return n;
+}
+
+
+//-- Multi-command sessions ---------------------------------------------------
+//
+// Each leg becomes a scheduler stream while it's running. Legs are checked
+// when they're added: the airtime needed by the legs running at any time
+// (which need only be checked at the start of each leg) mustn't exceed what
+// the scheduler can fit, and legs on the same channel mustn't overlap (the
+// collar can only do one thing at a time).
+//
+void CollarSession::begin(CollarRadio &r, collar_key k) {
+	sched.begin(r);
+	key = k;
+	running = 0;
+	clear();
+}
+
+void CollarSession::clear() {
+	char i;
+
+	cancel();
+	for(i = 0; i < COLLAR_LEGS; i++)
+		legs[i].chan = 0;
+}
+
+// Airtime needed by the legs running at time t, in 1/1024ths. Returns
+// more than 1024 if two legs on the same channel overlap.
+//
+int CollarSession::load(unsigned long t) {
+	collar_leg *l;
+	int d = 0;
+	char i, chans = 0;
+
+	for(i = 0, l = legs; i < COLLAR_LEGS; i++, l++) {
+		if(!l->chan || t < l->at || t - l->at >= l->durn) continue;
+		if(chans & l->chan) return 1025;
+		chans |= l->chan;
+		d += CollarScheduler::cost(l->deadline);
+	}
+	return d;
+}
+
+// Add a leg.
+// chan	= channel (1 or 2)
+// cmd	= command
+// pwr	= power level (0..100)
+// at	= start time, ms after start()
+// durn	= duration (ms)
+// deadline = max time between packets (ms)
+// Returns the leg number, or -1 if invalid, there's no room, or it won't
+// fit alongside the legs running at the same time.
+//
+int CollarSession::leg(char chan, collar_cmd cmd, char pwr, unsigned long at,
+			unsigned long durn, unsigned int deadline) {
+	collar_pkt pkt;
+	collar_leg *l = 0;
+	char i;
+
+	if(running || !durn || (chan != 1 && chan != 2)
+	|| !SharedCollar::packet(pkt, key, chan, cmd, pwr))
+		return -1;
+	for(i = 0; i < COLLAR_LEGS && !l; i++)
+		if(!legs[i].chan) l = &legs[i];
+	if(!l) return -1;
+	l->chan = chan;
+	l->cmd = cmd;
+	l->pwr = pwr;
+	l->id = -1;
+	l->at = at;
+	l->durn = durn;
+	l->deadline = deadline;
+	for(i = 0; i < COLLAR_LEGS; i++)	// Check where legs start
+		if(legs[i].chan && load(legs[i].at) > 1024) {
+			l->chan = 0;
+			return -1;
+		}
+	return l - legs;
+}
+
+// Start (or restart) the session from the top, whether or not it's been
+// run before
+//
+void CollarSession::start() {
+	cancel();
+	t0 = millis();
+	running = 1;
+}
+
+// Call regularly while running. Stops legs that have run their time,
+// starts those that are due, and sends the next packet.
+// Returns 1 while running, 0 once all the legs are done.
+//
+char CollarSession::service() {
+	collar_leg *l;
+	unsigned long t;
+	char i, more = 0;
+
+	if(!running) return 0;
+	t = millis() - t0;
+	for(i = 0, l = legs; i < COLLAR_LEGS; i++, l++)	// Stop legs first
+		if(l->chan && l->id != -2 && t >= l->at
+			   && t - l->at >= l->durn) {
+			if(l->id >= 0) sched.remove(l->id);
+			l->id = -2;				// Done
+		}
+	for(i = 0, l = legs; i < COLLAR_LEGS; i++, l++) {	// Then start
+		if(!l->chan || l->id == -2) continue;
+		more = 1;
+		if(l->id == -1 && t >= l->at)
+			l->id = sched.add(key, l->chan, l->cmd, l->pwr,
+								l->deadline);
+	}
+	sched.service();
+	if(!more) running = 0;
+	return more;
+}
+
+// Stop everything, and reset the legs so the session can be run again
+//
+void CollarSession::cancel() {
+	char i;
+
+	sched.clear();
+	running = 0;
+	for(i = 0; i < COLLAR_LEGS; i++)
+		legs[i].id = -1;
+}
+
 
 //== Remote receiver code =====================================================
 //
 //-- Set up remote receiver ---------------------------------------------------
 //
 void ShockCollarRemote::begin(char pin) {
+	unsigned char i;
+
 	remote_pin = pin;	// Input data pin
 	pinMode(pin, INPUT);
-	pt = et = st = 0;	// Timers
+	pt = 0;			// Timers
+	for(i = 0; i < COLLAR_REMOTES; i++)
+		remotes[i].chan = remotes[i].down = 0;	// No remotes seen
+	release = 120000;	// Allowing for a couple of lost packets
 	state = 0;		// Idling
-	bit = 99;		// Invalid
+	for(i = 0; i < COLLAR_DECODERS; i++)
+		dec[i].bit = 99;	// Invalid
 	expect_key = 0;		// Expect key;
+	rx = COLLAR_RX_POLL;	// Polled
+	slop = 150;		// Allowing for late polls
+	mhead = mtail = 0;	// Nothing queued
+	lost = 0;
+	stats(counts);		// Clear statistics
+}
+
+
+//-- Interrupt-driven front end -----------------------------------------------
+//
+// A pin change interrupt timestamps each edge into a ring buffer, and
+// receive() drains it through edge(), so it no longer has to be called
+// every 100us; only often enough that the buffer doesn't fill (a packet is
+// 84 edges, so 64 is around 30ms). The ISR is the only writer of rxhead and
+// receive() of rxtail, and they're bytes, so no locking is needed. Each
+// entry is the micros() time with the pin level in bit 0 (on an AVR it's a
+// multiple of 4 anyway; on the host, an odd time is rounded up, so an edge
+// is never logged before it happened). There's only the one buffer, so only
+// one remote at a time can use it (whichever way it's filled), and it's
+// only compiled in if one of the front ends that fill it is, as it's a good
+// part of a small board's RAM.
+//
+#ifdef COLLAR_RXQ
+#define RXQ	COLLAR_EDGES			// Buffer size
+static_assert(!(RXQ & (RXQ - 1)) && RXQ <= 128, "Bad COLLAR_EDGES");
+
+static volatile unsigned long rxq[RXQ];		// Edge times | level
+static volatile unsigned char rxhead, rxtail;	// Ring indices
+static volatile unsigned int rxdrop;		// Overruns
+static ShockCollarRemote *rxowner;		// Remote using it
+
+static void rxput(unsigned long t, char level) {
+	if((unsigned char)(rxhead - rxtail) >= RXQ) {	// Full: drop it
+		rxdrop++;
+		return;
+	}
+	rxq[rxhead & (RXQ - 1)] = ((t + 1) & ~1UL) | level;
+	rxhead++;
+}
+#endif
+
+#ifdef COLLAR_PININT
+static char rxpin;				// Pin interrupting
+
+static void rxedge() {
+	rxput(micros(), digitalRead(rxpin) == HIGH);
+}
+#endif
+
+// Or Timer1's input capture unit can latch the time of each edge on the
+// ICP1 pin in hardware, so the pulse lengths come out exact to within a
+// couple of microseconds however long interrupts are held off, and the
+// receiver can be much fussier about them. The timer runs at clk/8, as for
+// the transmit engine (which can share it), and the overflow interrupt
+// extends it to 32 bits. The capture edge alternates, starting with the
+// opposite of the pin's state, so each capture's edge is known. Times are
+// in microseconds, but not the same ones as micros().
+//
+#ifdef COLLAR_CAPTURE
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+#define ICP_PORT	PB			// Uno pin 8
+#define ICP_BIT		0
+#else
+#define ICP_PORT	PD			// Leonardo pin 4
+#define ICP_BIT		4
+#endif
+#define TPUS		(F_CPU / 8000000L)	// Timer ticks per us
+
+static volatile unsigned long rxovf;		// Timer1 overflows
+
+ISR(TIMER1_OVF_vect) {
+	rxovf++;
+}
+
+ISR(TIMER1_CAPT_vect) {
+	unsigned int c = ICR1;
+	unsigned long h = rxovf;
+	char level = TCCR1B & (1 << ICES1) ? 1 : 0;	// Rose or fell
+
+	TCCR1B ^= 1 << ICES1;				// Other edge next
+	TIFR1 = 1 << ICF1;
+	if((TIFR1 & (1 << TOV1)) && c < 0x8000)		// Wrapped, not
+		h++;					// counted yet
+	rxput(h * (65536 / TPUS) + c / TPUS, level);
+}
+#endif
+
+// Cheap receiver modules chatter when there's no signal, and each spike
+// would cost an interrupt and a pass through the decoder. Alternatively,
+// Timer1's compare B interrupt samples the pin every COLLAR_SAMPLE_US, and
+// only passes on changes that get past a filter: either the new level must
+// outlast the old by n samples (debounce), or a majority of the last n
+// samples must agree.
+// Either way, spikes shorter than about n / 2 samples are dropped (and
+// counted) at a fixed cost, and both edges of a pulse are delayed alike,
+// so its length is kept. The timer runs at clk/8, as for the transmit
+// engine (which can share it). The fixed cost isn't small: each sample is
+// around 5us at 16MHz, most of it getting in and out of the interrupt, so
+// about 10% of the processor at 50us. A longer period costs less, but
+// times the edges more coarsely (see the slop in rxmode()), and a 250us
+// pulse has to be a few samples long for the filter to leave it be.
+//
+#define SAMPLE_US	COLLAR_SAMPLE_US	// Sample period
+static_assert(SAMPLE_US >= 20 && SAMPLE_US <= 100, "Bad COLLAR_SAMPLE_US");
+
+static unsigned char rxfkind = COLLAR_MAJORITY;	// Filter
+static unsigned char rxfn = 3;			// and samples
+static volatile unsigned int rxnoise;		// Glitches
+
+#ifdef COLLAR_SAMPLE
+static volatile unsigned char *rxin;		// Pin's port
+static unsigned char rxmask;			// and bit
+static unsigned char rxhist;			// Last 8 samples
+static char rxraw, rxlevel;			// Last sample, filtered
+static unsigned char rxcount;			// Filter state
+
+ISR(TIMER1_COMPB_vect) {
+	char s = (*rxin & rxmask) != 0;
+	char f = rxlevel;
+
+	OCR1B += SAMPLE_US * (F_CPU / 8000000L);	// Next sample
+	if(s != rxraw) {				// Count changes,
+		rxraw = s;				// less the ones
+		rxnoise++;				// passed on
+	}
+	rxhist = rxhist << 1 | s;
+	if(rxfkind == COLLAR_MAJORITY) {
+		rxcount += s - ((rxhist >> rxfn) & 1);	// Ones in window
+		f = rxcount > rxfn / 2;
+	}
+	else if(s == rxlevel) {				// Debounce:
+		if(rxcount) rxcount--;			// integrate, so
+	}						// a spike doesn't
+	else if(++rxcount >= rxfn)			// start it again
+		f = s;
+	if(f != rxlevel) {
+		rxlevel = f;
+		rxcount = 0;
+		if(rxfkind == COLLAR_MAJORITY)		// Restart window
+			rxcount = f ? rxfn : 0;
+		rxhist = f ? 0xff : 0;
+		rxnoise--;
+		rxput(micros(), f);
+	}
+}
+#endif
+
+// Set the sampling receiver's filter.
+// f	= COLLAR_DEBOUNCE or COLLAR_MAJORITY
+// n	= samples, 1..7 (odd for COLLAR_MAJORITY)
+//
+void ShockCollarRemote::rxfilter(collar_filter f, char n) {
+	if(n < 1) n = 1;
+	if(n > 7) n = 7;
+	noInterrupts();
+	rxfkind = f;
+	rxfn = n;
+#ifdef COLLAR_SAMPLE
+	rxcount = f == COLLAR_MAJORITY && rxlevel ? n : 0;
+	rxhist = rxlevel ? 0xff : 0;
+#endif
+	interrupts();
+}
+
+// Number of changes the filter has thrown out (wraps around)
+//
+unsigned int ShockCollarRemote::noise() {
+	unsigned int n;
+
+	noInterrupts();
+	n = rxnoise;
+	interrupts();
+	return n;
+}
+
+// Select the receiver front end, and the pulse length tolerance to suit.
+// Returns 1 if OK, 0 if the pin can't be used that way or another remote
+// has the buffer.
+//
+int ShockCollarRemote::rxmode(collar_rx mode) {
+#ifdef COLLAR_PININT
+	int i = digitalPinToInterrupt(remote_pin);
+#endif
+
+	switch(rx) {					// Release it
+#ifdef COLLAR_PININT
+	case COLLAR_RX_PIN:
+		detachInterrupt(i);
+		break;
+#endif
+#ifdef COLLAR_CAPTURE
+	case COLLAR_RX_CAPTURE:
+		TIMSK1 &= ~(1 << ICIE1 | 1 << TOIE1);
+		break;
+#endif
+#ifdef COLLAR_SAMPLE
+	case COLLAR_RX_SAMPLE:
+		TIMSK1 &= ~(1 << OCIE1B);
+		break;
+#endif
+	default:
+		break;
+	}
+#ifdef COLLAR_RXQ
+	if(rx != COLLAR_RX_POLL) rxowner = 0;
+#endif
+	rx = COLLAR_RX_POLL;
+	slop = 150;					// Late polls
+
+	switch(mode) {
+	case COLLAR_RX_POLL:
+		return 1;
+#ifdef COLLAR_PININT
+	case COLLAR_RX_PIN:
+		if(i == NOT_AN_INTERRUPT || (rxowner && rxowner != this))
+			return 0;
+		rxpin = remote_pin;
+		rxtail = rxhead;			// Empty
+		attachInterrupt(i, rxedge, CHANGE);
+		slop = 100;				// Interrupt latency
+		break;
+#endif
+#ifdef COLLAR_CAPTURE
+	case COLLAR_RX_CAPTURE:
+		if(digitalPinToPort(remote_pin) != ICP_PORT	// ICP1 only
+		|| digitalPinToBitMask(remote_pin) != 1 << ICP_BIT
+		|| (rxowner && rxowner != this))
+			return 0;
+		rxtail = rxhead;
+		state = digitalRead(remote_pin);
+		noInterrupts();
+		TCCR1A = 0;				// Normal mode, clk/8,
+		TCCR1B = 1 << ICNC1 | (state ? 0 : 1 << ICES1) | 1 << CS11;
+		TIFR1 = 1 << ICF1 | 1 << TOV1;		// noise canceller
+		TIMSK1 |= 1 << ICIE1 | 1 << TOIE1;
+		interrupts();
+		slop = 60;				// Receiver's distortion
+		break;
+#endif
+#ifdef COLLAR_SAMPLE
+	case COLLAR_RX_SAMPLE:
+		if(rxowner && rxowner != this) return 0;
+		rxin = portInputRegister(digitalPinToPort(remote_pin));
+		rxmask = digitalPinToBitMask(remote_pin);
+		rxtail = rxhead;
+		state = rxraw = rxlevel = digitalRead(remote_pin) == HIGH;
+		rxfilter((collar_filter)rxfkind, rxfn);
+		noInterrupts();
+		TCCR1A = 0;				// Normal mode, clk/8
+		TCCR1B = (TCCR1B & (1 << ICNC1 | 1 << ICES1)) | 1 << CS11;
+		OCR1B = TCNT1 + SAMPLE_US * (F_CPU / 8000000L);
+		TIFR1 = 1 << OCF1B;
+		TIMSK1 |= 1 << OCIE1B;
+		interrupts();
+		slop = 50 + SAMPLE_US;			// Sample period
+		break;
+#endif
+	default:
+		return 0;
+	}
+#ifdef COLLAR_RXQ
+	rxowner = this;
+#endif
+	rx = mode;
+	return 1;
 }
 
 
@@ -249,72 +1347,93 @@ void ShockCollarRemote::begin(char pin) {
 //
 char ShockCollarRemote::receive() {
 	char b;
-	char c, p, m, cx, mx;
-	collar_cmd cmd;
-	collar_key k;
-	long ct, t;
 
-	// Read input pin to see if it has changed.
-	// If it's the start of a pulse, record the time.
+	// If an interrupt's collecting edges, work through them until
+	// one completes a packet (the rest can wait for the next call).
 	//
-	b = digitalRead(remote_pin);	// Get pin state
-	if(b == state) return 0;	// If no change, we're done
-	state = b;			// Save state
-	ct = micros();			// Get time
-	if(state == 1) {		// Pulse start?
-		pt = ct;		// Save start time
-		return 0;		// And adios!
-	}
+#ifdef COLLAR_RXQ
+	unsigned long e;
+	char r;
 
-	// If we've returned to 0, see how long that pulse was.
-	// We allow lots of slop in this measurement because we're polling 
-	// and may have been late reading one end or the other of the pulse.
-	// Basically, we should be OK if we can get to this every 100us
-	// or so.
-	//
-	t = ct - pt;			// Pulse length
-	if(t > 100 && t < 400)		// ~250us = 0
-		b = 0;
-	else if(t > 600 && t < 900) 	// ~750us = 1
-		b = 1;
-	else if(t > 1300 && t < 1700) {	// ~1500us = start
-		for(b = 0; b < 5; b++)	// Erase the packet
-			pkt[b] = 0;
-		bit = 0;		// Start bit counter
-		st = ct;		// and record start time
+	if(rx != COLLAR_RX_POLL) {
+		while(rxtail != rxhead) {
+			e = rxq[rxtail & (RXQ - 1)];
+			rxtail++;
+			b = e & 1;
+			if(b == state) continue;	// Missed one
+			state = b;
+			if((r = edge(b, e & ~1UL))) return r;
+		}
 		return 0;
 	}
-	else	return 0;		// Noise. Shrug.
+#endif
 
-	// We have a data bit. Put it in the packet (if there's room)
-	// Done if we don't have 40 bits yet ... or if the timing of the
-	// packet is off. (Should be just under 40ms).
-	//
-	if(bit >= 40) return 0;
-	pkt[bit >> 3] |= b << (7 - (bit & 7));
-	t = ct - st;			// Time since start bit
-	if(++bit != 40 || t < 37000 || t > 42000) return 0;
-
-	// Extract the bits from the packet
-	// pkt[4] is pkt[0] complemented and reversed. So when we check
-	// values in pkt[0] (c & m) for validity, we'll also check that
-	// the pkt[4] fields (mx & cx) also hold corresponding values.
+	// Otherwise, read input pin to see if it has changed.
 	//
+	b = digitalRead(remote_pin);	// Get pin state
+	if(b == state) return 0;	// If no change, we're done
+	state = b;			// Save state
+	return edge(b, micros());
+}
+
+//-- Statistics ---------------------------------------------------------------
+//
+// Counts of what the receiver has seen, to see why reception is poor. It's
+// all counters and compares, so it's kept up to date all the time.
+//
+// Add a pulse to a width summary
+//
+static void width(collar_width &w, long t) {
+	if(t < w.min) w.min = t;
+	if(t > w.max) w.max = t;
+	w.n++;
+	w.sum += t;
+}
+
+// Get a snapshot of the statistics, and (by default) reset them.
+// s	 = where to put them
+// reset = 0 to keep counting from where they are
+//
+void ShockCollarRemote::stats(collar_stats &s, char reset) {
+	collar_width *w;
+
+	noInterrupts();
+#ifdef COLLAR_RXQ
+	counts.overrun	= rxdrop;
+	if(reset) rxdrop = 0;
+#endif
+	counts.glitches = rxnoise;
+	if(reset) rxnoise = 0;
+	interrupts();
+	for(w = &counts.flag; w <= &counts.one; w++)
+		w->mean = w->n ? w->sum / w->n : 0;
+	if(&s != &counts) s = counts;
+	if(!reset) return;
+	memset(&counts, 0, sizeof(counts));
+	for(w = &counts.flag; w <= &counts.one; w++)
+		w->min = 0xffff;
+}
+
+
+//-- Check a received packet --------------------------------------------------
+//
+// pkt[4] is pkt[0] complemented and reversed. So when we check values in
+// pkt[0] (c & m) for validity, we'll also check that the pkt[4] fields
+// (mx & cx) also hold corresponding values.
+// Returns 1 if valid, with the channel and command, 0 if not.
+//
+static char check(collar_pkt &pkt, char &chan, collar_cmd &cmd) {
+	char c, m, cx, mx;
+
 	c =  pkt[0] >> 4;		// Channel & lead-in bit
 	m =  pkt[0] & 0xf;		// Mode (command)
-	k = (pkt[1] << 8) | pkt[2];	// Key
-	p =  pkt[3];			// Power
 	mx = pkt[4] >> 4;		// ModeX (see docs)
 	cx = pkt[4] & 0x0f;		// ChanX & trailer bit
 
-	// Check validity of key (if requested) 
-	//
-	if(expect_key && k != expect_key)	return 0;
-
 	// Check channel, lead-in & trailer bits
 	//
-	if(     c == 0b1000 && cx == 0b1110)	c = 1;
-	else if(c == 0b1111 && cx == 0b0000)	c = 2;
+	if(     c == 0b1000 && cx == 0b1110)	chan = 1;
+	else if(c == 0b1111 && cx == 0b0000)	chan = 2;
 	else 					return 0;
 
 	// and mode (command)
@@ -324,18 +1443,233 @@ char ShockCollarRemote::receive() {
 	else if(m == 0b0010 && mx == 0b1011)	cmd = COLLAR_VIB;
 	else if(m == 0b0001 && mx == 0b0111)	cmd = COLLAR_ZAP;
 	else					return 0;
+	return 1;
+}
+
+//-- Decode a pin change ------------------------------------------------------
+//
+// Called with each change of the input, and the time (micros()) it happened.
+// This is where the work's done; receive() just polls the pin, and other
+// front ends can feed edges in from elsewhere. Returns as for receive().
+//
+char ShockCollarRemote::edge(char level, unsigned long ct) {
+	collar_dec *d;
+	unsigned char i;
+	char r;
+	long t;
+
+	// If it's the start of a pulse, record the time.
+	//
+	counts.edges++;
+	collar_trace(COLLAR_TRACE_RX | remote_pin, level, ct);
+	if(level) {			// Pulse start?
+		pt = ct;		// Save start time
+		return 0;		// And adios!
+	}
+
+	// If we've returned to 0, see how long that pulse was. A start
+	// flag (~1500us, give or take 25%, see decode()) starts a packet,
+	// in a decoder of its own: one that's idle, or else the one that
+	// started longest ago. A burst of noise that looks like a flag
+	// in the middle of a packet would otherwise throw it away; this
+	// way the packet carries on in its own decoder, and the one the
+	// noise started just fails to add up. But a decoder that's had a
+	// flag and no bits since is restarted instead: the flags of a
+	// lead-in come back to back, and only the last is the packet's.
+	//
+	t = ct - pt;			// Pulse length
+	if(t > M_FLAG * 3 / 4 && t < M_FLAG * 5 / 4) {
+		width(counts.flag, t);
+		d = dec;
+		for(i = 0; i < COLLAR_DECODERS; i++)
+			if(!dec[i].bit) break;
+		if(i < COLLAR_DECODERS)
+			d = dec + i;
+		else for(i = 0; i < COLLAR_DECODERS; i++) {
+			if(dec[i].bit >= 40) {
+				d = dec + i;
+				break;
+			}
+			if(ct - dec[i].st > ct - d->st) d = dec + i;
+		}
+		if(d->bit && d->bit < 40) counts.aborted++;
+		for(i = 0; i < 5; i++)	// Erase the packet
+			d->pkt[i] = 0;
+		d->bit = 0;		// Start bit counter
+		d->dev = 0;
+		d->tsum = d->nsum = 0;	// Calibrate
+		calibrate(*d, t, M_FLAG / M_ZERO);
+		d->st = ct;		// and record start time
+		return 0;
+	}
+
+	// Otherwise, pass it to each decoder that's got a packet under way.
+	// The first to complete a valid packet wins, and the rest are
+	// reset, since they can only have been started by noise. If none
+	// of them take it as a bit, and it doesn't look like one (it may
+	// be the trailer, or from a packet whose flag we missed), it's
+	// noise.
+	//
+	hit = 0;
+	for(i = 0; i < COLLAR_DECODERS; i++)
+		if(dec[i].bit < 40 && (r = decode(dec[i], t, ct))) {
+			for(i = 0; i < COLLAR_DECODERS; i++) {
+				if(dec[i].bit < 40) counts.aborted++;
+				dec[i].bit = 99;
+			}
+			return r;
+		}
+	if(!hit && (t < M_ZERO - slop || t > M_ONE + slop
+	|| (t > M_ZERO + slop && t < M_ONE - slop)))
+		counts.noise++;
+	return 0;
+}
+
+//-- Decode a bit -------------------------------------------------------------
+//
+// Add a pulse to a packet being decoded, and if that completes it, check it
+// and pass it on. Returns as for receive().
+// d	= decoder
+// t	= pulse length (us)
+// ct	= time of the end of the pulse
+//
+// Remotes don't all keep to the nominal timings (and drift with temperature),
+// so each packet's start flag sets the length of a 250us unit for that
+// packet, refined by the first few bits (see calibrate()). Bits are then 1
+// or 3 units. We allow lots of slop in this measurement when polling,
+// because we may have been late reading one end or the other of the pulse.
+// Basically, we should be OK if we can get to this every 100us or so. With
+// the edges timed by an interrupt, or better still the timer hardware, it
+// can be tighter (see rxmode()), and is more likely to throw out noise than
+// to accept it as a bit.
+//
+char ShockCollarRemote::decode(collar_dec &d, long t, unsigned long ct) {
+	char b, c, p, j, fixed;
+	collar_cmd cmd;
+	collar_key k;
+	collar_remote *r, *e;
+	unsigned char i;
+	unsigned int u;
+
+	j = d.bit < 8 ? d.bit : d.bit >= 32 ? d.bit - 24 : -1;	// Checked bit?
+	if(t > d.unit - d.uslop && t < d.unit + d.uslop)	// ~250us = 0
+		b = 0;
+	else if(t > d.unit * (M_ONE / M_ZERO) - d.uslop	// ~750us = 1
+	     && t < d.unit * (M_ONE / M_ZERO) + d.uslop)
+		b = 1;
+	else if(j >= 0 && t > d.unit && t < d.unit * (M_ONE / M_ZERO))
+		b = 2;			// In between: guess (see below)
+	else	return 0;		// Noise. Shrug.
+
+	// We have a data bit. Put it in the packet and add up how far
+	// off it was, for the quality figure. For the bits in pkt[0] and
+	// pkt[4], which are checked against each other, also note how
+	// sure we are of it: how far it was from halfway between a 0 and
+	// a 1. Those bits can be guessed, and one bit that's wrong can be
+	// put right (see below).
+	// Done if we don't have 40 bits yet ... or if the timing of the
+	// packet is off. Every bit is 4 units from start to start, so the
+	// 39 between the first and the last give the packet's own unit to
+	// within a few us, much closer than the flag and first four bits
+	// can. That should agree with the unit we decoded with, and the
+	// first bit should follow the flag by its 3 unit space; if not, a
+	// flag (a lead-in, say) has been paired with later bits, or bits
+	// have gone missing.
+	//
+	if(b == 2)
+		b = t > d.unit * (M_ONE / M_ZERO + 1) / 2;
+	else if(d.bit < 4)
+		calibrate(d, t, b ? M_ONE / M_ZERO : 1);
+	if(!hit) {				// Once per pulse
+		width(b ? counts.one : counts.zero, t);
+		hit = 1;
+	}
+	d.pkt[d.bit >> 3] |= b << (7 - (d.bit & 7));
+	if(j >= 0) {
+		t -= d.unit * (M_ONE / M_ZERO + 1) / 2;
+		t = (t < 0 ? -t : t) >> 1;
+		d.conf[j] = t > 255 ? 255 : t;
+	}
+	t = ct - pt - (b ? d.unit * (M_ONE / M_ZERO) : d.unit);
+	d.dev += t < 0 ? -t : t;
+	if(!d.bit) d.bt = pt;		// Start of first bit
+	if(++d.bit != 40) return 0;
+	u = (pt - d.bt) / (39 * (M_ZERO + S_ZERO) / M_ZERO);
+	t = d.bt - d.st - u * (S_FLAG / M_ZERO);
+	if(t < -(long)u || t > (long)u
+	|| u < d.unit - d.unit / 8 || u > d.unit + d.unit / 8) {
+		counts.timing++;
+		return 0;
+	}
+
+	// Extract the key and power, and check validity of key (if
+	// requested)
+	//
+	k = (d.pkt[1] << 8) | d.pkt[2];	// Key
+	p =  d.pkt[3];			// Power
+	if(expect_key && k != expect_key) {
+		counts.wrongkey++;
+		return 0;
+	}
 
-	// Get the inter-packet time
-	// If it's less than 120ms (to allow for a couple of missed
-	// packets) since the last packet, and the packet is basically
-	// the same as last time, we can just return now with a return
-	// code of 2.
+	// Check the rest. If it doesn't add up, try again with the bit
+	// we were least sure of flipped. The valid combinations differ
+	// in at least four bits, so one wrong bit can't turn one valid
+	// packet into another, and putting it right is safe.
 	//
-	t = st - et;			// et is end time of last packet
-	et = ct;
-	if(t < 120000 && k == key && c == chan && cmd == command
-					       &&   p == power)
-		return 2;
+	fixed = 0;
+	if(!check(d.pkt, c, cmd)) {
+		for(i = 1, j = 0; i < 16; i++)
+			if(d.conf[i] < d.conf[j]) j = i;
+		j = j < 8 ? j : j + 24;
+		d.pkt[j >> 3] ^= 1 << (7 - (j & 7));
+		if(!check(d.pkt, c, cmd)) {
+			counts.invalid++;
+			return 0;
+		}
+		fixed = 1;
+		counts.fixed++;
+	}
+	counts.accepted++;
+
+	// Look the remote (key and channel) up in the table of those
+	// seen lately, or take over the slot least recently used. Then
+	// get the inter-packet time. If it's less than the release time
+	// (120ms, to allow for a couple of missed packets) since the
+	// last packet from that remote, and the packet is the same as
+	// last time, it's a repeat (the button's being held), return
+	// code 2. That way packets from several remotes at once don't
+	// count as new presses for each other. A new press ends any
+	// previous one from that slot.
+	//
+	r = remotes;
+	for(i = 0; i < COLLAR_REMOTES; i++) {
+		e = remotes + i;
+		if(e->chan == c && e->key == k) break;
+		if(r->chan && (!e->chan || ct - e->t > ct - r->t))
+			r = e;			// Oldest (or unused)
+	}
+	b = COLLAR_PRESS;
+	if(i < COLLAR_REMOTES) {		// Seen it before
+		r = e;
+		if(d.st - r->t < release && cmd == r->command && p == r->power)
+			b = COLLAR_HOLD;
+	}
+	if(b == COLLAR_PRESS) {
+		if(r->down) queue(*r, COLLAR_RELEASE, d.st);
+		r->down	= 1;
+		r->t0	= d.st;
+	}
+	r->key	   = k;
+	r->chan	   = c;
+	r->command = cmd;
+	r->power   = p;
+	t = 100 - (long)d.dev * 5 / (2 * d.uslop);	// Guesses can be way off
+	r->quality = t < 0 ? 0 : t;
+	r->fixed   = fixed;
+	r->t	   = ct;
+	queue(*r, b, ct);
+	if(b == COLLAR_HOLD) return 2;
 
 	// Copy the data into the object, and signal that we have a
 	// shiny new packet.
@@ -347,4 +1681,188 @@ char ShockCollarRemote::receive() {
 	return 1;
 }
 
+
+//-- Calibrate the classifier -------------------------------------------------
+//
+// Add a pulse to the measurements for a packet, and work out the unit
+// (nominally 250us) and slop from them, keeping within 25% of nominal.
+// t	= pulse length (us)
+// n	= nominal length in units
+//
+void ShockCollarRemote::calibrate(collar_dec &d, unsigned int t,
+				  unsigned char n) {
+	d.tsum += t;
+	d.nsum += n;
+	d.unit = d.tsum / d.nsum;
+	if(d.unit < M_ZERO * 3 / 4) d.unit = M_ZERO * 3 / 4;
+	if(d.unit > M_ZERO * 5 / 4) d.unit = M_ZERO * 5 / 4;
+	d.uslop = (long)slop * d.unit / M_ZERO;
+}
+
+
+//-- Received event queue -----------------------------------------------------
+//
+// Every packet edge() decodes is also queued, as a press (new) or hold
+// (repeat) event, along with when it arrived, how clean it was and how long
+// the button's been held, so the application can deal with them in its own
+// time (the key etc. fields only hold the last new one). When a remote's
+// packets stop for longer than the release time, a release event follows.
+// The queue holds COLLAR_MSGS; if it's full, further events are dropped
+// (and counted in lost) until there's room.
+//
+static_assert(!(COLLAR_MSGS & (COLLAR_MSGS - 1)) && COLLAR_MSGS <= 64,
+	      "Bad COLLAR_MSGS");
+
+void ShockCollarRemote::queue(collar_remote &r, char event, unsigned long t) {
+	if(event == COLLAR_RELEASE) r.down = 0;
+	if((unsigned char)(mhead - mtail) >= COLLAR_MSGS) {
+		lost++;
+		return;
+	}
+	collar_msg &q = msgs[mhead++ & (COLLAR_MSGS - 1)];
+	q.t	  = t;
+	q.key	  = r.key;
+	q.chan	  = r.chan;
+	q.command = r.command;
+	q.power	  = r.power;
+	q.event	  = event;
+	q.quality = r.quality;
+	q.fixed	  = r.fixed;
+	q.held	  = r.t - r.t0;
+}
+
+// The current time, on the same clock as the edges
+//
+static unsigned long rxnow(char rx) {
+#ifdef COLLAR_CAPTURE
+	if(rx == COLLAR_RX_CAPTURE) {
+		unsigned long h;
+		unsigned int c;
+
+		noInterrupts();
+		h = rxovf;
+		c = TCNT1;
+		if((TIFR1 & (1 << TOV1)) && c < 0x8000) h++;
+		interrupts();
+		return h * (65536 / TPUS) + c / TPUS;
+	}
+#endif
+	(void)rx;
+	return micros();
+}
+
+// available() first catches up on any edges the interrupt front end has
+// buffered (or takes a poll of the pin), so it can be called instead of
+// receive(), then looks for held buttons that have been released. Returns
+// the number of events waiting.
+//
+char ShockCollarRemote::available() {
+	unsigned long t;
+	unsigned char i;
+
+	if(rx == COLLAR_RX_POLL)
+		receive();
+	else	while(receive())
+			;
+	t = rxnow(rx);
+	for(i = 0; i < COLLAR_REMOTES; i++)
+		if(remotes[i].down && t - remotes[i].t >= release)
+			queue(remotes[i], COLLAR_RELEASE, t);
+	return mhead - mtail;
+}
+
+// Get the oldest packet waiting. Returns 1 if there was one, 0 if not.
+// m	= where to put it.
+//
+char ShockCollarRemote::pop(collar_msg &m) {
+	if(mhead == mtail) return 0;
+	m = msgs[mtail++ & (COLLAR_MSGS - 1)];
+	return 1;
+}
+
+
+//== Tracing ==================================================================
+//
+// The last COLLAR_TRACES pin changes (see ShockCollar.h), as the micros()
+// time with the level in bit 0, and the signal. The receiver's are logged
+// when receive() gets to them, after the fact, so the dump sorts them into
+// order. A host build provides its own collar_trace().
+//
+#if defined(COLLAR_TRACE) && !defined(COLLAR_HOST)
+#define TRACE_SIGS	8		// Signals in a dump
+
+static unsigned long trt[COLLAR_TRACES];	// Times | level
+static unsigned char trs[COLLAR_TRACES];	// Signals
+static unsigned char trn;			// Changes logged (mod 256)
+static char trfull;				// Wrapped round
+
+void collar_trace(unsigned char sig, char level, unsigned long t) {
+	unsigned char i = trn++ & (COLLAR_TRACES - 1);
+
+	trt[i] = (t & ~1UL) | (level != 0);
+	trs[i] = sig;
+	if(!(trn & (COLLAR_TRACES - 1))) trfull = 1;
+}
+
+// Print the changes as a VCD file, for GTKWave et c., and empty the buffer.
+// Times are in us from the first change, and the signals are called tx5,
+// led13, rx7 and so on.
+//
+void collar_trace_dump(Print &out) {
+	unsigned char sigs[TRACE_SIGS], done[COLLAR_TRACES / 8];
+	unsigned char n, f, ns = 0, i, j, k, b;
+	unsigned long t0 = 0;
+	long t, last = 0;
+
+	n = trfull ? COLLAR_TRACES : trn;
+	f = trfull ? trn & (COLLAR_TRACES - 1) : 0;	// Oldest
+
+	// Header, declaring the signals seen
+	//
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < ns && sigs[j] != trs[i]; j++)
+			;
+		if(j == ns && ns < TRACE_SIGS) sigs[ns++] = trs[i];
+	}
+	out.println(F("$timescale 1us $end"));
+	out.println(F("$scope module collar $end"));
+	for(j = 0; j < ns; j++) {
+		out.print(F("$var wire 1 "));
+		out.print((char)('!' + j));
+		out.print(sigs[j] & COLLAR_TRACE_RX  ? F(" rx") :
+			  sigs[j] & COLLAR_TRACE_LED ? F(" led") : F(" tx"));
+		out.print(sigs[j] & 0x3f);
+		out.println(F(" $end"));
+	}
+	out.println(F("$upscope $end"));
+	out.println(F("$enddefinitions $end"));
+
+	// Changes, earliest first (a selection sort; there aren't many)
+	//
+	memset(done, 0, sizeof(done));
+	for(k = 0; k < n; k++) {
+		b = 0xff;
+		for(i = 0; i < n; i++) {
+			j = (f + i) & (COLLAR_TRACES - 1);
+			if(done[j >> 3] & 1 << (j & 7)) continue;
+			if(b == 0xff || (long)(trt[j] - trt[b]) < 0) b = j;
+		}
+		done[b >> 3] |= 1 << (b & 7);
+		if(!k) t0 = trt[b] & ~1UL;
+		t = (trt[b] & ~1UL) - t0;
+		if(!k || t != last) {
+			out.print('#');
+			out.println(t);
+			last = t;
+		}
+		for(j = 0; j < ns && sigs[j] != trs[b]; j++)
+			;
+		if(j == ns) continue;
+		out.print((char)('0' + (trt[b] & 1)));
+		out.println((char)('!' + j));
+	}
+	trn = trfull = 0;
+}
+#endif
+
 //eof
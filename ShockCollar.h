@@ -9,6 +9,31 @@
 //
 #ifndef ShockCollar_h
 #define ShockCollar_h
+#include "ShockCollarHAL.h"
+
+// Build options
+// The interrupt driven transmitters and receivers claim hardware interrupt
+// vectors (and so clash with other users of Timer1 or USART1, such as the
+// Servo library or Serial1), and the receivers an edge buffer (see
+// COLLAR_EDGES). They are only compiled in if enabled here.
+//
+//#define COLLAR_TIMER			// Timer1 transmit engine (AVR only)
+//#define COLLAR_USART			// USART1 SPI-mode engine (AVR only)
+//#define COLLAR_PININT			// Pin interrupt receiver
+//#define COLLAR_CAPTURE		// Timer1 input capture receiver (AVR)
+//#define COLLAR_SAMPLE			// Timer1 sampling receiver (AVR only)
+//#define COLLAR_TRACE			// Trace pin changes (see README)
+
+// Sizes
+//
+#define COLLAR_STREAMS	4		// Streams per CollarScheduler
+#define COLLAR_LEGS	6		// Legs per CollarSession
+#define COLLAR_EDGES	64		// Receiver edge buffer (power of 2)
+#define COLLAR_MSGS	8		// Receiver packet queue (power of 2)
+#define COLLAR_REMOTES	4		// Remotes tracked by the receiver
+#define COLLAR_DECODERS	3		// Packets the receiver decodes at once
+#define COLLAR_TRACES	64		// Trace buffer (power of 2, <= 128)
+#define COLLAR_SAMPLE_US 50		// Sampling receiver's period (us)
 
 // Some data types & constants
 //
@@ -22,16 +47,171 @@ enum collar_cmd {
 };
 typedef unsigned int  collar_key;	// Key is 16 bit unsigned integer
 typedef unsigned char collar_pkt[5];	// 5-byte packet buffer
+#define COLLAR_PULSES 42		// Pulses per packet (flag + 41 bits)
+struct collar_wave {			// Rendered packet (see render()):
+	unsigned char len;		//   Pulse count, 0 if invalid
+	unsigned int  ipg;		//   Inter-packet gap (us)
+	unsigned char pulse[COLLAR_PULSES];	// Mark << 4 | space, 250us
+};
+#define COLLAR_P_FLAG	0x63		// Pulses: start flag  1500/750us
+#define COLLAR_P_ZERO	0x13		//	   zero bit     250/750us
+#define COLLAR_P_ONE	0x31		//	   one bit      750/250us
+#define COLLAR_LEADIN	2		// Default wake-up flags after a gap
+#define COLLAR_MAXLEAD	3		// Most wake-up flags (see leadin())
+#define COLLAR_IPG	7300		// Inter-packet gap (us)
+#define COLLAR_AIRTIME	51		// Time per packet, incl. IPG (ms)
+#define COLLAR_DEADLINE	120		// Max time between packets (ms)
+enum collar_tx {			// Transmitter backends:
+	COLLAR_TX_BLOCK = 0,		//   Bit-bang with delays (default)
+	COLLAR_TX_TIMER,		//   Timer1 compare interrupt
+	COLLAR_TX_USART			//   USART1 in SPI mode (TXD1 pin)
+};
+enum collar_rx {			// Receiver front end:
+	COLLAR_RX_POLL = 0,		//   receive() polls the pin
+	COLLAR_RX_PIN,			//   Pin change interrupt
+	COLLAR_RX_CAPTURE,		//   Timer1 input capture (ICP1)
+	COLLAR_RX_SAMPLE		//   Timer1 sampling, glitch filter
+};
+enum collar_filter {			// Sampling receiver's filter:
+	COLLAR_DEBOUNCE = 0,		//   n samples the same
+	COLLAR_MAJORITY			//   Majority of the last n
+};
+enum collar_state {			// Command state (see service()):
+	COLLAR_IDLE = 0,		//   None started
+	COLLAR_RUNNING,			//   In progress
+	COLLAR_DONE,			//   Ran to completion
+	COLLAR_CANCELLED		//   Stopped by cancel()
+};
+
+// Tracing. With COLLAR_TRACE, the blocking transmitters report each change
+// they make to the data and LED pins, and the receiver each change it
+// decodes, to collar_trace(), with the micros() time. Signals are a kind
+// and a pin (0..63). On a board the last COLLAR_TRACES changes are kept,
+// for collar_trace_dump() to print as a VCD file; on a host, the backend
+// provides collar_trace().
+//
+#define COLLAR_TRACE_TX		0x00	// Radio data pin
+#define COLLAR_TRACE_LED	0x40	// Activity LED
+#define COLLAR_TRACE_RX		0x80	// Receiver pin
+#ifdef COLLAR_TRACE
+void collar_trace(unsigned char sig, char level, unsigned long t);
+#ifndef COLLAR_HOST
+void collar_trace_dump(Print &out);	// Print as VCD, and empty
+#endif
+#else
+#define collar_trace(sig, level, t) ((void)0)
+#endif
 
-// Shock collar transmitter
+// Compile-time pin I/O for the ShockCollarT / ShockCollarRemoteT templates.
+// On the boards we know the pinout of, collar_io<pin> resolves the port and
+// bit at compile time, so set() and get() are single sbi/cbi/sbic
+// instructions. Pins are encoded port << 3 | bit, port B..F = 1..5, and the
+// PINx/DDRx/PORTx registers are at 0x23 + 3 * (port - 1) on. Elsewhere we
+// fall back to digitalWrite() / digitalRead(), and us is the ~5us a write
+// then takes, for the transmitter to allow for. A pin of -1 is a no-op.
 //
-class ShockCollar {
+#if defined(__AVR_ATmega32U4__)
+#define COLLAR_FASTIO
+constexpr unsigned char collar_pinmap[] = {	// Leonardo / Pro Micro
+	032, 033, 031, 030, 034, 026, 037, 046,	//  0.. 7 D2 D3 D1 D0 D4 C6 D7 E6
+	014, 015, 016, 017, 036, 027, 013, 011,	//  8..15 B4 B5 B6 B7 D6 C7 B3 B1
+	012, 010, 057, 056, 055, 054, 051, 050,	// 16..23 B2 B0 F7 F6 F5 F4 F1 F0
+	034, 037, 014, 015, 016, 036, 035 };	// 24..30 D4 D7 B4 B5 B6 D6 D5
+#elif defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+#define COLLAR_FASTIO
+constexpr unsigned char collar_pinmap[] = {	// Uno / Nano / Pro Mini
+	030, 031, 032, 033, 034, 035, 036, 037,	//  0.. 7 D0..D7
+	010, 011, 012, 013, 014, 015,		//  8..13 B0..B5
+	020, 021, 022, 023, 024, 025 };		// 14..19 C0..C5
+#endif
+
+template<char P> struct collar_io {
+#ifdef COLLAR_FASTIO
+	static_assert(P >= 0 && P < (int)sizeof(collar_pinmap), "No such pin");
+	static constexpr unsigned char pin = collar_pinmap[(unsigned char)P];
+	static constexpr int us = 0;			// Write time (us)
+	static volatile unsigned char &reg(char r) {	// 0 PIN, 2 PORT
+		return *(volatile unsigned char *)(0x23 + 3 * ((pin >> 3) - 1) + r);
+	}
+	static void set(char on) {
+		if(on)	reg(2) |=   1 << (pin & 7);
+		else	reg(2) &= ~(1 << (pin & 7));
+	}
+	static char get() { return (reg(0) >> (pin & 7)) & 1; }
+#else
+	static constexpr int us = 5;
+	static void set(char on) { digitalWrite(P, on); }
+	static char get() { return digitalRead(P); }
+#endif
+};
+template<> struct collar_io<-1> {
+	static void set(char) {}
+	static char get() { return 0; }
+};
+
+class SharedCollar;
+
+// Radio transmitter
+// Owns the data pin (and activity LED) and the transmit clock, and sends
+// packets for any number of collars, keeping the inter-packet gaps right
+// between them.
+//
+class CollarRadio {
 private:
 	char collar_pin;		// Data pin to send via
 	char collar_led;		// Data pin to flash activity LED
+	collar_tx mode;			// Transmitter backend
+	volatile unsigned char *out;	// Data pin port & bit (async modes)
+	volatile unsigned char *lout;	// LED pin port & bit (0 if no LED)
+	unsigned char omask, lmask;
+	SharedCollar *collars;		// Registered collars
+	SharedCollar *rr;		// Next to service
+	unsigned char lead;		// Lead-in flags
+	unsigned long leadgap;		// Idle time before they're needed
+	char warm;			// Carrier pre-warmed?
+	unsigned long warmt;		// When
+	unsigned char leadflags(unsigned long idle);
+	void txqueue(collar_wave &w);	// Queue for Timer1 engine
+	void usqueue(collar_wave &w);	// Queue for USART engine
+	friend class SharedCollar;
+
+protected:
 	unsigned long sclk;		// Transmit clock
+	virtual void sendpulse(int on, int off);	// Send a pulse
+	virtual void blink(char on);	// Set activity LED
+	virtual void carrier(char on);	// Set data pin
+
+public:
+	void begin(char pin, char led);
+	void begin(char pin) { begin(pin, -1); }
+	void send(collar_wave &w);
+	int  txmode(collar_tx mode);	// Select transmitter backend
+	char busy();			// Packets queued or in flight?
+	char full();			// Would send() wait for room?
+	void flush();			// Wait for transmitter to go idle
+	char service();			// Service registered collars
+	void leadin(unsigned char flags, unsigned long gap);
+	void prewarm();			// Start the carrier early
+};
+
+// Shock collar on a shared radio
+// Everything but the radio itself, so collars sharing one (and the
+// fixed-pin variant, which has its own) don't each carry a spare.
+//
+class SharedCollar {
+private:
+	CollarRadio *radio;		// Radio to send via
+	SharedCollar *next;		// Next collar on the radio
 	unsigned long lastkeepalive = 0;	// Last KA packet time
-	void sendpulse(int on, int off);	// Send a pulse
+	collar_pkt cpkt[2];		// Render cache: packets
+	collar_wave cwave[2];		//		 and their pulses
+	char cnext;			//		 next slot to replace
+	collar_pkt cmdpkt[2];		// Command: packets for chan 1 & 2
+	collar_state cstate;		//	    state
+	char cchan, cstep;		//	    channels, next to send
+	long cdurn;			//	    duration / packet count
+	unsigned long ctime;		//	    start time (ms)
+	friend class CollarRadio;
 
 public:
 	// Parameters
@@ -40,13 +220,27 @@ public:
 	int (*interrupt)(void);		// Interrupt poll function
 
 	// Methods
-	void begin(char pin, char led);
-	void begin(char pin) { begin(pin, -1); }
+	void begin(CollarRadio &r);	// Share a radio
 	int  command(collar_cmd cmd, char chan, char pwr, long durn);
+	int  begin_command(collar_cmd cmd, char chan, char pwr, long durn);
+	char service();			// Returns 1 while command running
+	void cancel();
+	collar_state state() { return cstate; }
 	void keepalive();
-	int  packet(collar_pkt &pkt, collar_key key, char chan,
+	unsigned long keepalive_due();	// ms until keepalive() sends
+	static int packet(collar_pkt &pkt, collar_key key, char chan,
 					collar_cmd cmd, char pwr);
 	void send(collar_pkt &pkt);
+	static int render(collar_wave &w, collar_pkt &pkt);
+	void send(collar_wave &w)	{ radio->send(w); }
+	void send_P(const collar_wave *w);	// w in PROGMEM
+	int  txmode(collar_tx mode)	{ return radio->txmode(mode); }
+	char busy()			{ return radio->busy(); }
+	char full()			{ return radio->full(); }
+	void flush()			{ radio->flush(); }
+	void leadin(unsigned char flags, unsigned long gap) {
+					  radio->leadin(flags, gap); }
+	void prewarm()			{ radio->prewarm(); }
 
 	// Shortcut methods
 	int  led(char chan, long durn) {
@@ -55,30 +249,313 @@ public:
 		return command(COLLAR_BEEP, chan, 1,   durn);	}
 	int  vib(char chan, long durn, char pwr) {
 		return command(COLLAR_VIB,  chan, pwr, durn);	}
-	int  led(char chan, long durn, char pwr) {
-		return command(COLLAR_ZAP, chan,  pwr, durn);	}
+	int  zap(char chan, long durn, char pwr) {
+		return command(COLLAR_ZAP,  chan, pwr, durn);	}
+};
+
+// Shock collar, with a radio of its own
+//
+class ShockCollar : public SharedCollar {
+private:
+	CollarRadio own;		// Its radio
+
+public:
+	using SharedCollar::begin;
+	void begin(char pin, char led);
+	void begin(char pin) { begin(pin, -1); }
+};
+
+// Packet scheduler
+// Keeps a number of streams of packets (key, chan, cmd, pwr) going at once on
+// one radio, interleaving them so each gets a packet within its deadline.
+//
+struct collar_stream {			// Stream:
+	collar_pkt pkt;			//   Packet (pkt[0] = 0 if unused)
+	unsigned int deadline;		//   Max time between packets (ms)
+	unsigned char slots;		//   Deadline in packet times (2^n)
+	unsigned long last;		//   Time last packet sent (ms)
+};
+
+class CollarScheduler {
+private:
+	CollarRadio *radio;		// Radio to send via
+	collar_stream stream[COLLAR_STREAMS];
+	int density(int except);	// Airtime used (1/1024ths)
+
+public:
+	unsigned long misses;		// Packets sent late
+
+	void begin(CollarRadio &r);
+	int  add(collar_key key, char chan, collar_cmd cmd, char pwr,
+				unsigned int deadline = COLLAR_DEADLINE);
+	void remove(int id);
+	void clear();			// Remove all streams
+	char service();			// Returns no. of active streams
+	int  load() { return density(-1); }
+	static int cost(unsigned int deadline);	// Airtime for a stream
+};
+
+// Multi-command session
+// A set of commands ("legs") for the collars on one key, each with its own
+// channel, command, power, start time and duration, run at once on a
+// scheduler.
+//
+struct collar_leg {			// Leg:
+	char chan;			//   Channel (0 if unused)
+	collar_cmd cmd;			//   Command
+	char pwr;			//   Power
+	char id;			//   Scheduler stream, -1 if not running
+	unsigned long at, durn;		//   Start & length (ms)
+	unsigned int deadline;		//   Packet deadline (ms)
+};
+
+class CollarSession {
+private:
+	CollarScheduler sched;		// Scheduler to run legs on
+	collar_leg legs[COLLAR_LEGS];
+	collar_key key;			// Key for all legs
+	unsigned long t0;		// Start time
+	char running;
+	int  load(unsigned long t);	// Airtime needed at t
+
+public:
+	void begin(CollarRadio &r, collar_key key);
+	int  leg(char chan, collar_cmd cmd, char pwr, unsigned long at,
+		 unsigned long durn, unsigned int deadline = COLLAR_DEADLINE);
+	void clear();			// Remove all legs
+	void start();
+	char service();			// Returns 1 while running
+	void cancel();
+	unsigned long misses() { return sched.misses; }
 };
 
 // Shock collar remote receiver
 //
+enum collar_event {			// Received button events:
+	COLLAR_PRESS = 1,		//   New command (receive() 1)
+	COLLAR_HOLD,			//   Repeat	 (receive() 2)
+	COLLAR_RELEASE			//   No more repeats
+};
+struct collar_msg {			// Received event (see pop()):
+	unsigned long t;		//   Time (end of packet)
+	collar_key key;			//   Key
+	char chan;			//   Channel, 1, 2
+	char command;			//   Command (COLLAR_xxx)
+	char power;			//   Power 0..100
+	char event;			//   COLLAR_PRESS etc.
+	unsigned char quality;		//   Timing, 0..100 (100 = exact)
+	char fixed;			//   1 if a bit was corrected
+	unsigned long held;		//   Time (us) since pressed
+};
+
+struct collar_remote {			// Remote seen by the receiver:
+	collar_key key;			//   Key
+	char chan;			//   Channel (0 = unused)
+	char command;			//   Last command
+	char power;			//   and power
+	char down;			//   Button held?
+	unsigned char quality;		//   Last packet's quality
+	char fixed;			//   and whether it was corrected
+	unsigned long t0;		//   Time pressed
+	unsigned long t;		//   Time of its last packet
+};
+
+struct collar_dec {			// Packet being received:
+	collar_pkt pkt;			//   Packet buffer
+	char bit;			//   Bit counter (40+ = idle)
+	unsigned int dev;		//   Total timing error
+	unsigned char conf[16];		//   Confidence in pkt[0] & pkt[4] bits
+	unsigned int tsum;		//   Calibration: pulse lengths,
+	unsigned char nsum;		//     in 250us units
+	unsigned int unit;		//   Measured 250us
+	int uslop;			//   and slop, scaled to suit
+	unsigned long st;		//   Start time
+	unsigned long bt;		//   Start of first bit
+};
+
+struct collar_width {			// Pulse widths (us):
+	unsigned int min, max, mean;	//   Shortest, longest, average
+	unsigned int n;			//   Number
+	unsigned long sum;		//   Total
+};
+struct collar_stats {			// Receiver statistics:
+	unsigned long edges;		//   Changes decoded
+	unsigned int overrun;		//   Changes lost, buffer full
+	unsigned int glitches;		//   Spikes filtered out
+	unsigned int noise;		//   Pulses not a flag or bit
+	unsigned int aborted;		//   Packets abandoned part way
+	unsigned int timing;		//   Packets the wrong length
+	unsigned int invalid;		//   Failed channel/mode checks
+	unsigned int wrongkey;		//   Not expect_key
+	unsigned int fixed;		//   Put right (see decode())
+	unsigned int accepted;		//   Good packets
+	collar_width flag, zero, one;	//   Start flag, 0 and 1 marks
+};
+
 class ShockCollarRemote {
 private:
-	collar_pkt pkt;			// Packet buffer
-	char bit;			// Bit counter
-	unsigned long pt, st, et;	// Pulse start, pkt start & end times
-	char state;			// Last pin state
+	collar_dec dec[COLLAR_DECODERS];	// Packets under way
+	collar_stats counts;		// Statistics
+	char hit;			// Pulse was a bit
+	char decode(collar_dec &d, long t, unsigned long ct);
+	void calibrate(collar_dec &d, unsigned int t, unsigned char n);
+	unsigned long pt;		// Pulse start time
 	char remote_pin;		// Data pin to listen to
+	collar_remote remotes[COLLAR_REMOTES];	// Remotes seen lately
+	collar_msg msgs[COLLAR_MSGS];	// Packet queue
+	unsigned char mhead, mtail;
+	void queue(collar_remote &r, char event, unsigned long t);
+
+protected:
+	char state;			// Last pin state
+	char rx;			// Front end
 
 public:
 	collar_key expect_key;		// If non-0, only this key
+	int slop;			// Pulse length tolerance (us)
+	unsigned long release;		// Time (us) before a release
 	collar_key key;			// Returns: Key
 	char chan;			//	    Channel, 1, 2
 	char command;			//	    Command (COLLAR_xxx)
 	char power;			//	    Power 0..100
 
 	void begin(char pin);		// Initialise
+	int rxmode(collar_rx mode);	// Select front end
+	void rxfilter(collar_filter f, char n);	// Set sampling filter
+	unsigned int noise();		// Glitches filtered out
+	void stats(collar_stats &s, char reset = 1);	// Get statistics
 	char receive();			// Returns 1 for new packet,
-};					//	   2 for repeat, 0 meh.
+					//	   2 for repeat, 0 meh.
+	char edge(char level, unsigned long t);	// Decode a pin change
+	unsigned char lost;		// Packets dropped, queue full
+	char available();		// Packets queued
+	char pop(collar_msg &m);	// Get the oldest
+};
+
+// Fixed-pin variants. These do the same job, but with the pins known at
+// compile time, so the pin I/O is a single instruction on the boards
+// collar_io knows (and digitalWrite() / digitalRead() otherwise). That
+// makes the pulse edges exact, and lets the receiver poll several times
+// faster.
+//	ShockCollarT<14, LED_BUILTIN> collar;	collar.begin();
+//	CollarRadioT<14> radio;			radio.begin();
+//	ShockCollarRemoteT<15> remote;		remote.begin();
+//
+template<char Pin, char Led = -1>
+class CollarRadioT : public CollarRadio {
+protected:
+	void sendpulse(int on, int off) {
+		long t = sclk - micros();
+		if(t > 0) delayMicroseconds(t);
+		collar_io<Pin>::set(1);
+		collar_trace(COLLAR_TRACE_TX | Pin, HIGH, micros());
+		delayMicroseconds(on - collar_io<Pin>::us);
+		collar_io<Pin>::set(0);
+		collar_trace(COLLAR_TRACE_TX | Pin, LOW, micros());
+		sclk += on + off;
+	}
+	void blink(char on) {
+		collar_io<Led>::set(on);
+		if(Led >= 0) collar_trace(COLLAR_TRACE_LED | Led, on, micros());
+	}
+	void carrier(char on) {
+		collar_io<Pin>::set(on);
+		collar_trace(COLLAR_TRACE_TX | Pin, on, micros());
+	}
+
+public:
+	void begin() { CollarRadio::begin(Pin, Led); }
+};
+
+template<char Pin, char Led = -1>
+class ShockCollarT : public SharedCollar {
+private:
+	CollarRadioT<Pin, Led> tradio;
+
+public:
+	void begin() { tradio.begin(); SharedCollar::begin(tradio); }
+};
+
+template<char Pin>
+class ShockCollarRemoteT : public ShockCollarRemote {
+public:
+	void begin() { ShockCollarRemote::begin(Pin); }
+	char receive() {
+		if(rx) return ShockCollarRemote::receive();
+		char b = collar_io<Pin>::get();
+		if(b == state) return 0;
+		state = b;
+		return edge(b, micros());
+	}
+};
+
+// Compile-time packets
+// CollarPacket<key, chan, cmd, pwr>::pkt and ::wave are the packet and its
+// rendered pulse table, built by the compiler and stored in PROGMEM, e.g.
+//	typedef CollarPacket<0xbeef, 1, COLLAR_ZAP, 100> Zap;
+//	collar.send_P(&Zap::wave);
+// The constexpr functions follow SharedCollar::packet() and render().
+//
+constexpr unsigned char collar_head(char chan, collar_cmd cmd) {
+	return (chan == 1 ? 0b10000000 : 0b11110000) |	// lcccmmmm
+		(cmd == COLLAR_LED  ? 0b00001000 :
+		 cmd == COLLAR_BEEP ? 0b00000100 :
+		 cmd == COLLAR_VIB  ? 0b00000010 : 0b00000001);
+}
+constexpr unsigned char collar_tail(char chan, collar_cmd cmd) {
+	return (chan == 1 ? 0b00001110 : 0b00000000) |	// MMMMCCCt
+		(cmd == COLLAR_LED  ? 0b11100000 :
+		 cmd == COLLAR_BEEP ? 0b11010000 :
+		 cmd == COLLAR_VIB  ? 0b10110000 : 0b01110000);
+}
+constexpr unsigned char collar_byte(collar_key key, char chan,
+			collar_cmd cmd, unsigned char pwr, unsigned char i) {
+	return i == 0 ? collar_head(chan, cmd) :
+	       i == 1 ? key >> 8 :
+	       i == 2 ? key & 0xff :
+	       i == 3 ? (cmd == COLLAR_LED || cmd == COLLAR_BEEP ? 0 : pwr) :
+			collar_tail(chan, cmd);
+}
+constexpr unsigned char collar_pulse(collar_key key, char chan,
+			collar_cmd cmd, unsigned char pwr, unsigned char n) {
+	return n == 0 ? COLLAR_P_FLAG : n > 40 ? COLLAR_P_ZERO :
+		(collar_byte(key, chan, cmd, pwr, (n - 1) >> 3)
+				>> (7 - ((n - 1) & 7))) & 1 ?
+		COLLAR_P_ONE : COLLAR_P_ZERO;
+}
+
+template<unsigned char... I> struct collar_seq {};	// 0, 1, .. N-1
+template<unsigned char N, unsigned char... I>
+struct collar_mkseq : collar_mkseq<N - 1, N - 1, I...> {};
+template<unsigned char... I>
+struct collar_mkseq<0, I...> { typedef collar_seq<I...> type; };
+
+template<collar_key K, char C, collar_cmd M, unsigned char P, class S>
+struct collar_progmem;
+template<collar_key K, char C, collar_cmd M, unsigned char P,
+							unsigned char... I>
+struct collar_progmem<K, C, M, P, collar_seq<I...> > {
+	static_assert(C == 1 || C == 2, "Collar channel must be 1 or 2");
+	static_assert(M >= COLLAR_LED && M <= COLLAR_ZAP,
+					"Collar command must be LED..ZAP");
+	static const collar_pkt  pkt;
+	static const collar_wave wave;
+};
+template<collar_key K, char C, collar_cmd M, unsigned char P,
+							unsigned char... I>
+const collar_pkt collar_progmem<K, C, M, P, collar_seq<I...> >::pkt
+	PROGMEM = { collar_byte(K, C, M, P, 0), collar_byte(K, C, M, P, 1),
+		    collar_byte(K, C, M, P, 2), collar_byte(K, C, M, P, 3),
+		    collar_byte(K, C, M, P, 4) };
+template<collar_key K, char C, collar_cmd M, unsigned char P,
+							unsigned char... I>
+const collar_wave collar_progmem<K, C, M, P, collar_seq<I...> >::wave
+	PROGMEM = { COLLAR_PULSES, COLLAR_IPG,
+		    { collar_pulse(K, C, M, P, I)... } };
+
+template<collar_key key, char chan, collar_cmd cmd, unsigned char pwr>
+struct CollarPacket : collar_progmem<key, chan, cmd, pwr,
+			typename collar_mkseq<COLLAR_PULSES>::type> {};
 
 #endif // ShockCollar_h
 //-- End of header file -------------------------------------------------------
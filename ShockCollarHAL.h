@@ -0,0 +1,25 @@
+// Shock collar driver hardware abstraction
+//
+// The driver only uses a handful of the Arduino core's functions: the clock
+// (micros(), millis()), delays, pin I/O and pin change interrupts, plus
+// PROGMEM. On an Arduino they come from the core. Built with COLLAR_HOST
+// defined, they come from collar_host.h instead, which must provide the same
+// names; extras/host has one for Linux et c. that runs on a virtual clock
+// and records pin changes, so the driver can be built and measured off
+// the board. See README.txt.
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#ifndef ShockCollarHAL_h
+#define ShockCollarHAL_h
+
+#ifdef COLLAR_HOST
+#include <collar_host.h>
+#else
+#include <Arduino.h>
+#endif
+
+#endif
@@ -0,0 +1,344 @@
+// Shock collar driver, loopback benchmark
+//
+// Records bursts of packets from ShockCollar::send(), passes them through a
+// model of a poor channel, and replays them into ShockCollarRemote, counting
+// how many come out right. The channel can:
+//	-j us	move each edge up to this much either way (jitter)
+//	-d p	lose each edge with this probability
+//	-g n	add n glitches (2-40us spikes) per second
+//	-p us	call receive() only this often (0 = after every edge)
+// and the receiver can use its polled (-m poll) or pin interrupt (-m pin)
+// front end. For each setting it reports the packet error rate, the real
+// CPU time receiving takes per packet, and the (virtual) time from the
+// start of a burst to its first packet coming out of the receiver.
+//
+// With no channel options, it sweeps each in turn from a clean channel, to
+// help pick settings and catch changes to the decoder's tolerances. The
+// exit status is 1 if any packets are lost on the clean channel.
+//
+//	collar_bench [-m pin|poll] [-j us] [-d p] [-g n] [-p us]
+//		     [-b packets] [-t trials] [-s seed]
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ShockCollar.h"
+
+#define TX_PIN		5		// Radio data pin
+#define RX_PIN		7		// Receiver data pin
+#define KEY		0x1234
+#define BURST		10		// Packets per burst (default)
+#define TRIALS		20		// Bursts per setting (default)
+#define MATCH		10000		// Max difference in end time (us)
+#define TAIL		200000		// Time to keep polling after (us)
+
+struct chan_model {			// Channel & receiver:
+	collar_rx mode;			//   Front end
+	unsigned int jitter;		//   Edge jitter, +/- us
+	double drop;			//   Chance of losing an edge
+	double glitch;			//   Glitches per second
+	unsigned long poll;		//   receive() interval (us)
+};
+
+struct result {				// Totals for a setting:
+	unsigned long sent, ok, wrong;	//   Packets, decoded, garbled
+	double cpu;			//   Real time receiving (s)
+	double latency;			//   Total first-packet latency (us)
+	unsigned int bursts;		//   Bursts with a packet
+};
+
+static host_edge *rec;			// Recorded burst
+static unsigned int nrec;
+static unsigned int burst = BURST;
+static collar_pkt sent[256];		// and its packets,
+static char schan[256];			//   their channels,
+static collar_cmd scmd[256];		//	 commands
+static unsigned long pend[256];		//   and end times
+static host_edge *out;			// Burst after the channel
+static unsigned int nout, outsize;
+
+//-- Random numbers -----------------------------------------------------------
+//
+// Our own, so the runs are the same everywhere.
+//
+static unsigned long long rs;
+
+static unsigned long rnd() {
+	rs ^= rs << 13;
+	rs ^= rs >> 7;
+	rs ^= rs << 17;
+	return rs >> 32;
+}
+
+static double rndf() {			// 0 <= x < 1
+	return rnd() / 4294967296.0;
+}
+
+//-- Transmitter --------------------------------------------------------------
+//
+// Send a burst of packets with different channels, commands and powers, and
+// record the pin changes.
+//
+static void record() {
+	static const collar_cmd cmds[] = {
+		COLLAR_LED, COLLAR_BEEP, COLLAR_VIB, COLLAR_ZAP };
+	ShockCollar c;
+	unsigned int i, size = burst * 128;	// 84-88 edges a packet
+
+	rec = (host_edge *)malloc(size * sizeof(host_edge));
+	outsize = 3 * size;
+	out = (host_edge *)malloc(outsize * sizeof(host_edge));
+	host_reset();
+	c.begin(TX_PIN);
+	host_record(TX_PIN, rec, size);
+	for(i = 0; i < burst; i++) {
+		schan[i] = 1 + rnd() % 2;
+		scmd[i] = cmds[rnd() % 4];
+		ShockCollar::packet(sent[i], KEY, schan[i], scmd[i],
+				    rnd() % 101);
+		c.send(sent[i]);
+		c.flush();
+		pend[i] = rec[host_edges() - 1].t;
+	}
+	nrec = host_edges();
+	for(i = 0; i < burst; i++)	// Times from the first edge
+		pend[i] -= rec[0].t;
+	for(i = nrec; i-- > 0; )
+		rec[i].t -= rec[0].t;
+}
+
+//-- Channel ------------------------------------------------------------------
+//
+// Put the recorded burst through the channel into out[], starting at time
+// t0. Glitches are flips of the line that don't run into the next edge, and
+// a lost edge also loses the one after (as the line doesn't change). There
+// can be any number of glitches, so out[] grows to fit.
+//
+static void put(unsigned long t, char level) {
+	if(nout == outsize) {
+		outsize *= 2;
+		out = (host_edge *)realloc(out, outsize * sizeof(host_edge));
+	}
+	out[nout].t = t;
+	out[nout++].level = level;
+}
+
+static void channel(chan_model &m, unsigned long t0) {
+	unsigned int i;
+	unsigned long t, prev = t0, end = t0 + rec[nrec - 1].t + 1000;
+	unsigned long g = t0, w;
+	char level = 0;
+
+	nout = 0;
+	if(m.glitch > 0)
+		g += (unsigned long)(-1e6 / m.glitch * log(1 - rndf()));
+	for(i = 0; i <= nrec; i++) {
+		t = i < nrec ? t0 + rec[i].t : end;
+		if(i < nrec && m.jitter)
+			t += rnd() % (2 * m.jitter + 1) - m.jitter;
+		if(t <= prev) t = prev + 1;
+
+		// Glitches before this edge
+		//
+		while(m.glitch > 0 && g < t) {
+			w = 2 + rnd() % 39;
+			if(g > prev && g + w < t) {
+				put(g, !level);
+				put(g + w, level);
+			}
+			g += 1 + (unsigned long)
+				 (-1e6 / m.glitch * log(1 - rndf()));
+		}
+		if(i == nrec) break;
+		if(rndf() < m.drop) continue;
+		put(t, rec[i].level);
+		level = rec[i].level;
+		prev = t;
+	}
+}
+
+//-- Receiver -----------------------------------------------------------------
+//
+static ShockCollarRemote remote;
+static unsigned int cur;		// Next packet to match
+static char got[256];
+static unsigned long t0, first;		// Burst start, first packet
+
+// Match received packets to the ones sent: same contents, ending at about
+// the same time.
+//
+static void drain(result &r) {
+	collar_msg m;
+	unsigned long e;
+	long d;
+
+	while(remote.receive())
+		;
+	remote.available();
+	while(remote.pop(m)) {
+		if(m.event == COLLAR_RELEASE) continue;
+		while(cur < burst && t0 + pend[cur] + MATCH < m.t) cur++;
+		e = cur < burst ? t0 + pend[cur] : 0;
+		d = m.t - e;
+		if(cur < burst && d < MATCH && d > -MATCH && !got[cur] &&
+		   m.key == KEY && m.chan == schan[cur] &&
+		   m.command == scmd[cur] && m.power == (char)sent[cur][3]) {
+			got[cur] = 1;
+			r.ok++;
+			if(!first) first = micros();
+		} else
+			r.wrong++;
+	}
+}
+
+static void trial(chan_model &m, result &r) {
+	unsigned int i;
+	unsigned long tp, end;
+	timespec a, b;
+
+	host_reset();
+	remote.begin(RX_PIN);
+	remote.rxmode(m.mode);
+	t0 = 10000;
+	channel(m, t0);
+	memset(got, 0, sizeof(got));
+	cur = 0;
+	first = 0;
+	tp = m.poll ? 1 + rnd() % m.poll : 0;	// Poll at random phase
+	end = out[nout - 1].t + TAIL;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for(i = 0; i < nout; i++) {
+		while(m.poll && tp <= out[i].t) {
+			host_advance(tp - micros());
+			drain(r);
+			tp += m.poll;
+		}
+		host_advance(out[i].t - micros());
+		host_input(RX_PIN, out[i].level);
+		if(!m.poll) drain(r);
+	}
+	while(m.poll && tp <= end) {
+		host_advance(tp - micros());
+		drain(r);
+		tp += m.poll;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	r.cpu += b.tv_sec - a.tv_sec + (b.tv_nsec - a.tv_nsec) * 1e-9;
+	r.sent += burst;
+	if(first) {
+		r.latency += first - t0;
+		r.bursts++;
+	}
+}
+
+//-- Sweep --------------------------------------------------------------------
+//
+// Each parameter in turn, from a clean channel with the receiver called after
+// every edge. Polled receivers are swept by how often they're polled, as it's
+// what limits their timing.
+//
+static const struct {
+	char param;			// Parameter swept
+	double v[8];			// Its values (-1 ends)
+} sweep[] = {
+	{ 'j', { 0, 25, 50, 75, 100, 150, 200, -1 } },
+	{ 'd', { 0.0003, 0.001, 0.003, 0.01, -1 } },
+	{ 'g', { 30, 100, 300, 1000, 3000, -1 } },
+	{ 'p', { 1000, 10000, 20000, 30000, 50000, -1 } },
+	{ 'q', { 20, 50, 100, 150, 200, 300, -1 } },	// Polled front end
+};
+
+static unsigned int trials = TRIALS;
+
+static double run(chan_model &m) {
+	result r;
+	unsigned int i;
+	double per;
+
+	memset(&r, 0, sizeof(r));
+	for(i = 0; i < trials; i++)
+		trial(m, r);
+	per = 1 - (double)r.ok / r.sent;
+	printf("%-5s %6u %7.4f %8.0f %8lu  %7lu %7.4f %5lu %8.2f %8.1f\n",
+	       m.mode == COLLAR_RX_POLL ? "poll" : "pin",
+	       m.jitter, m.drop, m.glitch, m.poll, r.sent, per, r.wrong,
+	       r.cpu * 1e6 / r.sent,
+	       r.bursts ? r.latency / r.bursts / 1000 : 0.0);
+	return per;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: collar_bench [-m pin|poll] [-j us] [-d p] "
+			"[-g n] [-p us]\n"
+			"\t\t    [-b packets] [-t trials] [-s seed]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	chan_model m, c;
+	char one = 0;
+	unsigned int i, j;
+	int o, bad = 0;
+
+	memset(&m, 0, sizeof(m));
+	m.mode = COLLAR_RX_PIN;
+	rs = 1;
+	while((o = getopt(argc, argv, "m:j:d:g:p:b:t:s:")) != -1) {
+		switch(o) {
+		case 'm':
+			if(!strcmp(optarg, "poll"))	m.mode = COLLAR_RX_POLL;
+			else if(!strcmp(optarg, "pin"))	m.mode = COLLAR_RX_PIN;
+			else				usage();
+			break;
+		case 'j': m.jitter = atoi(optarg); one = 1; break;
+		case 'd': m.drop = atof(optarg); one = 1; break;
+		case 'g': m.glitch = atof(optarg); one = 1; break;
+		case 'p': m.poll = atol(optarg); one = 1; break;
+		case 'b': burst = atoi(optarg); break;
+		case 't': trials = atoi(optarg); break;
+		case 's': rs = strtoull(optarg, 0, 0) | 1; break;
+		default: usage();
+		}
+	}
+	if(optind != argc || !burst || burst > 256 || !trials) usage();
+
+	record();
+	printf("front jitter    drop glitch/s     poll  packets     PER "
+	       "wrong  cpu/pkt  latency\n"
+	       "         us                         us                  "
+	       "         us       ms\n");
+	if(one) {
+		run(m);
+		return 0;
+	}
+
+	// Clean channel first (any losses are a fault), then the sweeps
+	//
+	bad = run(m) > 0;
+	for(i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++) {
+		printf("\n");
+		for(j = 0; sweep[i].v[j] >= 0; j++) {
+			c = m;
+			switch(sweep[i].param) {
+			case 'j': c.jitter = sweep[i].v[j]; break;
+			case 'd': c.drop = sweep[i].v[j]; break;
+			case 'g': c.glitch = sweep[i].v[j]; break;
+			case 'p': c.poll = sweep[i].v[j]; break;
+			case 'q': c.mode = COLLAR_RX_POLL;
+				  c.poll = sweep[i].v[j]; break;
+			}
+			run(c);
+		}
+	}
+	return bad;
+}
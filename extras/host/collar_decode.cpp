@@ -0,0 +1,397 @@
+// Shock collar driver, offline capture decoder
+//
+// Decodes a capture of a receiver's output, faster than real time, using
+// ShockCollarRemote's decoder. The capture is memory-mapped and split into
+// as many pieces as there are cores, each decoded by its own thread and
+// receiver. Each starts decoding a little (PREROLL) before its piece, so
+// its receiver has found a start flag, and seen any packet under way, by
+// the time it gets there; it keeps only the packets that end in its piece.
+//
+// Captures are either binary, 32-bit little-endian words of the micros()
+// time with the level in bit 0 (as the receiver's edge buffer has them,
+// wrapping round every 71 minutes), or CSV, lines of time and level, the
+// time in us, or in seconds if it has a decimal point (other lines, e.g.
+// headings, are skipped).
+//	-f bin|csv	format (by default CSV if the name ends .csv)
+//	-j n		threads (one per core)
+//	-k key		only this key (see expect_key)
+//	-s		statistics only, no packet log
+//
+// It prints a log of the packets, with their time since the start of the
+// capture, then statistics for each key, and the receiver's (see stats()).
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ShockCollar.h"
+
+#define THREADS		64		// Max threads
+#define PREROLL		250000		// Time decoded before a piece (us)
+#define MINPIECE	65536		// Smallest piece worth a thread
+
+struct capture {			// Capture file:
+	const char *p;			//   Contents
+	size_t size;			//   and length
+	char csv;			//   CSV (else binary)
+};
+
+struct piece {				// Piece being decoded:
+	size_t from, start, end;	//   Decode from, keep [start, end)
+	unsigned long long u, v, w;	//   Times at start and end, last
+	char started, ended;
+	collar_msg *pkts;		//   Packets kept
+	unsigned int npkts, spkts;
+	collar_stats st;		//   Receiver statistics
+	pthread_t th;
+};
+
+struct keystats {			// Per key:
+	unsigned long pkts, presses;	//   Packets, button presses
+	unsigned long cmds[5];		//   Packets of each command
+	unsigned long fixed;		//   Corrected
+	unsigned long quality;		//   Total quality
+	char chans;			//   Channels seen (bits)
+	unsigned long long first, last;	//   Times
+};
+
+static capture cap;
+static piece pieces[THREADS];
+static collar_key expect;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-- Reading the capture ------------------------------------------------------
+//
+// Get the change at *o, and move *o past it. Returns 0 at the end.
+//
+static char next(size_t *o, unsigned long long *t, char *level) {
+	const unsigned char *b;
+	const char *p, *e = cap.p + cap.size;
+	unsigned long long s, f;
+	int n;
+
+	if(!cap.csv) {
+		if(*o + 4 > cap.size) return 0;
+		b = (const unsigned char *)cap.p + *o;
+		s = b[0] | b[1] << 8 | b[2] << 16 | (unsigned long)b[3] << 24;
+		*t = s & ~1UL;
+		*level = s & 1;
+		*o += 4;
+		return 1;
+	}
+	for(p = cap.p + *o; p < e; ) {
+		if(*p < '0' || *p > '9') {		// Not a change
+			while(p < e && *p++ != '\n')
+				;
+			continue;
+		}
+		for(s = 0; p < e && *p >= '0' && *p <= '9'; p++)
+			s = s * 10 + *p - '0';
+		if(p < e && *p == '.') {		// Seconds
+			for(p++, f = 0, n = 0; p < e && *p >= '0' && *p <= '9';
+									p++)
+				if(n < 6) {
+					f = f * 10 + *p - '0';
+					n++;
+				}
+			for(; n < 6; n++)
+				f *= 10;
+			s = s * 1000000 + f;
+		}
+		while(p < e && (*p == ',' || *p == ' ' || *p == '\t'))
+			p++;
+		*level = p < e && *p == '1';
+		while(p < e && *p++ != '\n')
+			;
+		*t = s;
+		*o = p - cap.p;
+		return 1;
+	}
+	*o = cap.size;
+	return 0;
+}
+
+// The start of the line (or word) before o
+//
+static size_t back(size_t o) {
+	if(!cap.csv) return o >= 4 ? o - 4 : 0;
+	if(o) o--;
+	while(o && cap.p[o - 1] != '\n')
+		o--;
+	return o;
+}
+
+// Time from a to b. Binary captures wrap round at 32 bits.
+//
+static unsigned long long since(unsigned long long a, unsigned long long b) {
+	return cap.csv ? b - a : (unsigned long)(unsigned int)(b - a);
+}
+
+//-- Decoding -----------------------------------------------------------------
+//
+// Decode from pc->from, keeping the packets that end in [start, end). Times
+// are made to run on from the first change (unwrapped), and u and v are the
+// times of the changes at start and end, to put the pieces together after.
+//
+static void *decode(void *arg) {
+	piece *pc = (piece *)arg;
+	ShockCollarRemote *r = new ShockCollarRemote;
+	unsigned long long raw, prev = 0, t = 0;
+	size_t o = pc->from, at;
+	collar_stats s;
+	collar_msg m;
+	char level, last = -1, got, first = 1;
+
+	pthread_mutex_lock(&lock);		// Not thread safe
+	r->begin(0);
+	r->expect_key = expect;
+	pthread_mutex_unlock(&lock);
+	while(at = o, next(&o, &raw, &level)) {
+		t = first ? raw : t + since(prev, raw);
+		prev = raw;
+		first = 0;
+		if(at >= pc->start && !pc->started) {
+			pc->started = 1;
+			pc->u = t;
+			pthread_mutex_lock(&lock);
+			r->stats(s);		// Forget the preroll's
+			pthread_mutex_unlock(&lock);
+		}
+		if(at >= pc->end) {
+			pc->ended = 1;
+			pc->v = t;
+			break;
+		}
+		if(level == last) continue;	// Missed one
+		last = level;
+		got = r->edge(level, t);
+		while(r->pop(m)) {
+			if(!got || !pc->started || m.event == COLLAR_RELEASE)
+				continue;
+			if(pc->npkts == pc->spkts) {
+				pc->spkts = pc->spkts ? pc->spkts * 2 : 1024;
+				pc->pkts = (collar_msg *)realloc(pc->pkts,
+					   pc->spkts * sizeof(collar_msg));
+			}
+			pc->pkts[pc->npkts++] = m;
+		}
+	}
+	pc->w = t;
+	pthread_mutex_lock(&lock);
+	r->stats(pc->st);
+	pthread_mutex_unlock(&lock);
+	if(!pc->started) memset(&pc->st, 0, sizeof(pc->st));
+	delete r;
+	return 0;
+}
+
+// Split the capture into n pieces at change boundaries, each starting to
+// decode PREROLL before it.
+//
+static void split(int n) {
+	unsigned long long t0, t;
+	size_t o, p;
+	char level;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		o = cap.size / n * i;
+		if(!cap.csv) o &= ~(size_t)3;
+		else if(o)  o = back(o + 1);	// Line it's in
+		pieces[i].start = o;
+		if(i) pieces[i - 1].end = o;
+	}
+	pieces[n - 1].end = cap.size;
+
+	for(i = 0; i < n; i++) {
+		o = pieces[i].start;
+		p = o;
+		if(!next(&p, &t0, &level)) {
+			pieces[i].from = o;
+			continue;
+		}
+		while(o && (p = back(o)) != o) {
+			o = p;
+			if(next(&p, &t, &level) && since(t, t0) >= PREROLL)
+				break;
+		}
+		pieces[i].from = o;
+	}
+}
+
+//-- Reporting ----------------------------------------------------------------
+//
+static const char *cmds[] = { "?", "led", "beep", "vib", "zap" };
+
+static void when(unsigned long long t) {
+	printf("%6llu.%06llu", t / 1000000, t % 1000000);
+}
+
+static void width(const char *name, collar_width &w) {
+	if(!w.n) return;
+	printf("    %-5s %6u %6u %6lu  (%u)\n", name, w.min, w.max,
+	       w.sum / w.n, w.n);
+}
+
+static void merge(collar_width &w, collar_width &x) {
+	if(!x.n) return;
+	if(!w.n || x.min < w.min) w.min = x.min;
+	if(!w.n || x.max > w.max) w.max = x.max;
+	w.n += x.n;
+	w.sum += x.sum;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: collar_decode [-f bin|csv] [-j threads] "
+			"[-k key] [-s] file\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	unsigned long long base = 0, t, end = 0;
+	int i, n = 0, o, fd, quiet = 0, fmt = -1;
+	unsigned int j, k;
+	collar_stats st;
+	keystats *ks;
+	collar_msg *m;
+	struct stat sb;
+	timespec a, b;
+	double secs;
+	char *name;
+
+	while((o = getopt(argc, argv, "f:j:k:s")) != -1) {
+		switch(o) {
+		case 'f':
+			if(!strcmp(optarg, "csv"))	fmt = 1;
+			else if(!strcmp(optarg, "bin"))	fmt = 0;
+			else				usage();
+			break;
+		case 'j': n = atoi(optarg); break;
+		case 'k': expect = strtoul(optarg, 0, 16); break;
+		case 's': quiet = 1; break;
+		default: usage();
+		}
+	}
+	if(optind != argc - 1 || n < 0 || n > THREADS) usage();
+	name = argv[optind];
+	k = strlen(name);
+	cap.csv = fmt >= 0 ? fmt : k > 4 && !strcmp(name + k - 4, ".csv");
+
+	// Map it in, and split it up
+	//
+	if((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		perror(name);
+		return 1;
+	}
+	cap.size = sb.st_size;
+	if(cap.size) {
+		cap.p = (const char *)mmap(0, cap.size, PROT_READ, MAP_PRIVATE,
+					   fd, 0);
+		if(cap.p == MAP_FAILED) {
+			perror(name);
+			return 1;
+		}
+		madvise((void *)cap.p, cap.size, MADV_SEQUENTIAL);
+	}
+	if(!n) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1) n = 1;
+	if(n > THREADS) n = THREADS;
+	if((size_t)n > cap.size / MINPIECE) n = cap.size / MINPIECE + 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	split(n);
+	for(i = 0; i < n; i++)
+		pthread_create(&pieces[i].th, 0, decode, pieces + i);
+	for(i = 0; i < n; i++)
+		pthread_join(pieces[i].th, 0);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	secs = b.tv_sec - a.tv_sec + (b.tv_nsec - a.tv_nsec) * 1e-9;
+
+	// Put the pieces back together: each starts where the last ended
+	// (as it saw it), and times are from the first change.
+	//
+	ks = (keystats *)calloc(65536, sizeof(keystats));
+	memset(&st, 0, sizeof(st));
+	if(!quiet)
+		printf("      time key  ch cmd  pwr event qual\n");
+	for(i = 0; i < n; i++) {
+		piece &pc = pieces[i];
+
+		for(j = 0; j < pc.npkts; j++) {
+			m = pc.pkts + j;
+			t = base + (m->t - pc.u);
+			keystats &s = ks[m->key];
+			if(!s.pkts) s.first = t;
+			s.last = t;
+			s.pkts++;
+			s.presses += m->event == COLLAR_PRESS;
+			s.cmds[(int)m->command]++;
+			s.fixed += m->fixed;
+			s.quality += m->quality;
+			s.chans |= m->chan;
+			if(quiet) continue;
+			when(t);
+			printf(" %04x %d  %-4s %3d %-5s %3d%s\n", m->key,
+			       m->chan, cmds[(int)m->command], m->power,
+			       m->event == COLLAR_PRESS ? "press" : "hold",
+			       m->quality, m->fixed ? " fixed" : "");
+		}
+		if(pc.started) end = base + (pc.w - pc.u);
+		if(pc.started && pc.ended) base += pc.v - pc.u;
+
+		st.edges    += pc.st.edges;
+		st.noise    += pc.st.noise;
+		st.aborted  += pc.st.aborted;
+		st.timing   += pc.st.timing;
+		st.invalid  += pc.st.invalid;
+		st.wrongkey += pc.st.wrongkey;
+		st.fixed    += pc.st.fixed;
+		st.accepted += pc.st.accepted;
+		merge(st.flag, pc.st.flag);
+		merge(st.zero, pc.st.zero);
+		merge(st.one,  pc.st.one);
+		free(pc.pkts);
+	}
+
+	// Statistics
+	//
+	printf("\n key  packets presses ch   led  beep   vib   zap fixed qual"
+	       "      first       last\n");
+	for(k = 0; k < 65536; k++) {
+		keystats &s = ks[k];
+		if(!s.pkts) continue;
+		printf("%04x %8lu %7lu %s %5lu %5lu %5lu %5lu %5lu %4lu ", k,
+		       s.pkts, s.presses,
+		       s.chans == 3 ? "12" : s.chans == 2 ? " 2" : " 1",
+		       s.cmds[COLLAR_LED], s.cmds[COLLAR_BEEP],
+		       s.cmds[COLLAR_VIB], s.cmds[COLLAR_ZAP], s.fixed,
+		       s.quality / s.pkts);
+		when(s.first);
+		printf(" ");
+		when(s.last);
+		printf("\n");
+	}
+	printf("\nReceiver: %lu changes, %u noise, %u aborted, %u wrong length,"
+	       "\n          %u invalid, %u wrong key, %u fixed, %u accepted\n",
+	       st.edges, st.noise, st.aborted, st.timing, st.invalid,
+	       st.wrongkey, st.fixed, st.accepted);
+	printf("  pulses    min    max   mean\n");
+	width("flag", st.flag);
+	width("zero", st.zero);
+	width("one",  st.one);
+	printf("\n%.1f MB, %.1f s of capture, in %.0f ms on %d thread%s "
+	       "(%.0fx real time)\n", cap.size / 1e6, end / 1e6, secs * 1e3, n,
+	       n == 1 ? "" : "s",
+	       secs > 0 ? end / 1e6 / secs : 0.0);
+	return 0;
+}
@@ -0,0 +1,166 @@
+// Shock collar driver, host backend
+//
+// See collar_host.h.
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include "collar_host.h"
+
+static unsigned long long now;			// Virtual clock (us)
+static unsigned long uoff, moff;		// micros(), millis() offsets
+static char level[HOST_PINS];			// Pin levels
+static void (*isr[HOST_PINS])(void);		// Attached interrupts
+static char masked, pending[HOST_PINS];		// noInterrupts()
+static host_hook hook;				// Output change hook
+static char recpin;				// Recording: pin (-1 all)
+static host_edge *rec;				//	      buffer
+static unsigned int recsize, nrec;
+
+//-- Clock --------------------------------------------------------------------
+//
+unsigned long micros() {
+	return (unsigned long)now + uoff;
+}
+
+unsigned long millis() {
+	return (unsigned long)(now / 1000) + moff;
+}
+
+void delayMicroseconds(unsigned int us) {
+	now += us;
+}
+
+void delay(unsigned long ms) {
+	now += ms * 1000;
+}
+
+void host_advance(unsigned long us) {
+	now += us;
+}
+
+unsigned long long host_time() {
+	return now;
+}
+
+// Set micros() and millis() so they wrap round after us and ms from now
+// (as they do every 71 minutes and 49 days on an Arduino, as unsigned long
+// is 32 bits). They wrap at 2^64 on 64-bit hosts, but the arithmetic's the
+// same.
+//
+void host_wrap(unsigned long us, unsigned long ms) {
+	uoff = 0UL - us - (unsigned long)now;
+	moff = 0UL - ms - (unsigned long)(now / 1000);
+}
+
+//-- Pins ---------------------------------------------------------------------
+//
+// Outputs are recorded and passed to the hook when they change. Levels are
+// kept for all pins, so reading an output gives what was written. Writes
+// take HOST_WRITE, as the transmitter's timing allows for (see sendpulse()),
+// and the pin changes at the end of it, so the change, anything the hook
+// loops it into, and the driver's trace (stamped with micros() after the
+// write) all have the same time.
+//
+void pinMode(uint8_t pin, uint8_t mode) {
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t l) {
+	now += HOST_WRITE;			// Not free on an AVR either
+	if(pin < HOST_PINS && level[pin] != (l != 0)) {
+		level[pin] = l != 0;
+		if(rec && (recpin < 0 || recpin == pin)) {
+			if(nrec < recsize) {
+				rec[nrec].t = now;
+				rec[nrec].pin = pin;
+				rec[nrec].level = level[pin];
+			}
+			nrec++;
+		}
+		if(hook) hook(pin, level[pin], now);
+	}
+}
+
+int digitalRead(uint8_t pin) {
+	return pin < HOST_PINS ? level[pin] : LOW;
+}
+
+// Drive an input, and run its interrupt if it changed (or hold it until
+// interrupts are enabled again).
+//
+void host_input(char pin, char l) {
+	if(pin < 0 || pin >= HOST_PINS || level[(int)pin] == (l != 0)) return;
+	level[(int)pin] = l != 0;
+	if(!isr[(int)pin]) return;
+	if(masked) pending[(int)pin] = 1;
+	else	   isr[(int)pin]();
+}
+
+//-- Interrupts ---------------------------------------------------------------
+//
+// Every pin can interrupt, on any change, and its interrupt number is the
+// pin number.
+//
+int digitalPinToInterrupt(int pin) {
+	return pin >= 0 && pin < HOST_PINS ? pin : NOT_AN_INTERRUPT;
+}
+
+void attachInterrupt(uint8_t irq, void (*f)(void), int mode) {
+	(void)mode;
+	if(irq < HOST_PINS) isr[irq] = f;
+}
+
+void detachInterrupt(uint8_t irq) {
+	if(irq < HOST_PINS) isr[irq] = 0;
+}
+
+void noInterrupts() {
+	masked = 1;
+}
+
+void interrupts() {
+	int i;
+
+	masked = 0;
+	for(i = 0; i < HOST_PINS; i++)
+		if(pending[i]) {
+			pending[i] = 0;
+			if(isr[i]) isr[i]();
+		}
+}
+
+//-- Host control -------------------------------------------------------------
+//
+void host_reset() {
+	now = 0;
+	uoff = moff = 0;
+	memset(level, 0, sizeof(level));
+	memset(isr, 0, sizeof(isr));
+	memset(pending, 0, sizeof(pending));
+	masked = 0;
+	hook = 0;
+	rec = 0;
+	nrec = 0;
+}
+
+void host_watch(host_hook h) {
+	hook = h;
+}
+
+// Record output changes on a pin (or all pins, pin = -1) into buf, from
+// now on. host_edges() counts them all, even those that didn't fit.
+//
+void host_record(char pin, host_edge *buf, unsigned int size) {
+	recpin = pin;
+	rec = buf;
+	recsize = size;
+	nrec = 0;
+}
+
+unsigned int host_edges() {
+	return nrec;
+}
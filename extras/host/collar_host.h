@@ -0,0 +1,69 @@
+// Shock collar driver, host backend
+//
+// Stands in for the Arduino core when the driver is built on a PC (with
+// COLLAR_HOST defined, see ShockCollarHAL.h). Time is virtual: it starts at
+// 0 and only moves when the driver delays, or the program moves it on, so
+// runs are repeatable and as fast as the PC allows. Pins are just levels;
+// changes to outputs can be recorded or passed to a hook (e.g. to loop a
+// transmitter back into a receiver), and inputs are driven by the program,
+// running any interrupt attached to them.
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#ifndef collar_host_h
+#define collar_host_h
+#include <stdint.h>
+#include <string.h>
+
+// The bits of the Arduino core the driver uses
+//
+#define HIGH		1
+#define LOW		0
+#define INPUT		0
+#define OUTPUT		1
+#define INPUT_PULLUP	2
+#define CHANGE		1
+#define NOT_AN_INTERRUPT -1
+#define PROGMEM
+#define memcpy_P	memcpy
+
+unsigned long micros();
+unsigned long millis();
+void delayMicroseconds(unsigned int us);
+void delay(unsigned long ms);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int  digitalRead(uint8_t pin);
+int  digitalPinToInterrupt(int pin);
+void attachInterrupt(uint8_t irq, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t irq);
+void noInterrupts();
+void interrupts();
+
+// Host control
+//
+#define HOST_PINS	64		// Pins 0..63, all can interrupt
+#define HOST_WRITE	5		// digitalWrite() time (us), as on AVR
+
+struct host_edge {			// Recorded output change:
+	unsigned long t;		//   Time (us)
+	char pin;			//   Pin
+	char level;			//   New level
+};
+typedef void (*host_hook)(char pin, char level, unsigned long t);
+
+void host_reset();			// Time 0, pins low, no hooks
+void host_advance(unsigned long us);	// Move the clock on
+unsigned long long host_time();		// Time since reset (us)
+void host_wrap(unsigned long us, unsigned long ms);	// Wrap clock in
+void host_input(char pin, char level);	// Drive an input
+void host_watch(host_hook h);		// Call h on output changes
+void host_record(char pin, host_edge *buf, unsigned int size);
+unsigned int host_edges();		// Number recorded (may exceed size)
+int  host_vcd(const char *file);	// Start tracing to a VCD file
+void host_vcd_close();			// Write it
+
+#endif
@@ -0,0 +1,293 @@
+// Shock collar driver, long-run simulation
+//
+// Runs a number of collars on one radio for days of virtual time: each keeps
+// its channel(s) alive, and gets a command now and then at random. Rather
+// than ticking, time jumps straight to whatever's next (a keepalive due, a
+// command starting, or the next packet of a running one), so a week takes a
+// fraction of a second. micros() and millis() are made to wrap part way
+// through, to check nothing minds.
+//	-n n	collars (4), keeping channel 1, 2, 3, 1 ... alive
+//	-d n	days to run (7)
+//	-c n	mean minutes between commands per collar (30)
+//	-b n	hours per line of the timeline (6)
+//	-u n	minutes until micros() wraps (60)
+//	-w n	hours until millis() wraps (half way)
+//	-s n	seed
+//
+// It prints a timeline of the packets each collar sent and the airtime
+// (radio busy time) they took, then totals. The exit status is 1 if any
+// collar went more than COLLAR_KEEPALIVE (plus a second) without a packet,
+// as it could have gone to sleep, or was kept alive early (a second or more
+// before it was due).
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ShockCollar.h"
+
+#define TX_PIN		5		// Radio data pin
+#define COLLARS		16		// Max collars
+#define KEEPALIVE	120000		// Keepalive period (ms), as driver
+#define LATE		(KEEPALIVE + 1000UL) * 1000	// Gap that's too long
+#define EARLY		(KEEPALIVE - 1000UL) * 1000	// Keepalive too soon
+#define FLAG		1000		// Marks longer than this (us) are flags
+#define LEADIN		10000		// Flags closer than this are lead-ins
+
+struct sim_collar {			// Collar:
+	SharedCollar c;
+	unsigned long long next;	//   Next command (us)
+	unsigned long long last;	//   Last packet
+	unsigned long long maxgap;	//   Longest between packets
+	unsigned long long ka;		//   Last keepalive (or command on
+	char chan;			//     the same channel), its channel
+	unsigned long late, early;	//   Gaps over LATE, keepalives early
+	unsigned long cmds, kas;	//   Commands, keepalives sent
+	unsigned long pkts, bpkts;	//   Packets, total & this line
+	unsigned long long air, bair;	//   Airtime, total & this line
+};
+
+static sim_collar col[COLLARS];
+static int ncol = 4;
+static int cur = -1;			// Collar sending
+static unsigned long long rise;		// Carrier on time
+static unsigned long long fend;		// Last flag's end
+static double cmdgap = 30;		// Mean minutes between commands
+
+//-- Random numbers -----------------------------------------------------------
+//
+static unsigned long long rs;
+
+static unsigned long rnd() {
+	rs ^= rs << 13;
+	rs ^= rs >> 7;
+	rs ^= rs << 17;
+	return rs >> 32;
+}
+
+static unsigned long long expo(double mean) {	// Exponential, mean us
+	return 1 + (unsigned long long)
+		   (-mean * log(1 - rnd() / 4294967296.0));
+}
+
+//-- Radio --------------------------------------------------------------------
+//
+// Count packets (by their flags, lead-in flags aside) against whichever
+// collar's sending, and the longest gap between its packets.
+//
+static void watch(char pin, char level, unsigned long t) {
+	unsigned long long now = host_time(), g;
+	sim_collar *s;
+
+	if(level) {
+		rise = now;
+		return;
+	}
+	if(cur < 0 || now - rise < FLAG) return;
+	g = rise - fend;
+	fend = now;
+	if(g < LEADIN) return;
+	s = col + cur;
+	g = rise - s->last;
+	if(g > s->maxgap) s->maxgap = g;
+	if(g > LATE) s->late++;
+	s->last = rise;
+	s->pkts++;
+	s->bpkts++;
+}
+
+// Let collar i send (by keepalive() or service()), counting the time the
+// radio's busy as its airtime. The blocking transmitter returns when the
+// packet's done.
+//
+static char run(int i, char keep) {
+	unsigned long long t = host_time();
+	unsigned long p = col[i].pkts;
+	char r = 0;
+
+	cur = i;
+	if(keep) col[i].c.keepalive();
+	else	 r = col[i].c.service();
+	cur = -1;
+	col[i].air  += host_time() - t;
+	col[i].bair += host_time() - t;
+	if(keep && col[i].pkts != p) {
+		col[i].kas++;
+		if(col[i].kas > 1 && t - col[i].ka < EARLY) col[i].early++;
+		col[i].ka = host_time();
+	}
+	if(!keep && !r && col[i].chan == col[i].c.kchan)
+		col[i].ka = host_time();	// Counts as one
+	return r;
+}
+
+//-- Commands -----------------------------------------------------------------
+//
+// A random command for a few seconds, on a random channel.
+//
+static void command(int i) {
+	static const collar_cmd cmds[] = {
+		COLLAR_LED, COLLAR_BEEP, COLLAR_VIB, COLLAR_ZAP };
+	sim_collar &s = col[i];
+
+	s.chan = 1 + rnd() % 3;
+	s.c.begin_command(cmds[rnd() % 4], s.chan, rnd() % 101,
+			  500 + rnd() % 4500);
+	s.cmds++;
+	s.next = host_time() + expo(cmdgap * 60e6);
+}
+
+//-- Report -------------------------------------------------------------------
+//
+static void when(unsigned long long t) {
+	t /= 60000000;				// Minutes
+	printf("%3llud %02llu:%02llu", t / 1440, t / 60 % 24, t % 60);
+}
+
+static void line(unsigned long long t, unsigned long long len, char uw,
+								char mw) {
+	int i;
+
+	when(t);
+	printf(" %c%c", uw ? 'u' : ' ', mw ? 'm' : ' ');
+	for(i = 0; i < ncol; i++) {
+		printf(" %6lu %5.2f%%", col[i].bpkts,
+		       100.0 * col[i].bair / len);
+		col[i].bpkts = 0;
+		col[i].bair = 0;
+	}
+	printf("\n");
+}
+
+static void usage() {
+	fprintf(stderr, "usage: collar_sim [-n collars] [-d days] "
+			"[-c minutes] [-b hours]\n"
+			"\t\t  [-u minutes] [-w hours] [-s seed]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	double days = 7, uwrap = 60, mwrap = -1, bucket = 6;
+	unsigned long long end, bend, blen, now, next, t;
+	unsigned long us, ms, d;
+	char uw = 0, mw = 0, busy;
+	int i, o, rr = 0, bad = 0;
+	CollarRadio radio;
+	timespec a, b;
+
+	rs = 1;
+	while((o = getopt(argc, argv, "n:d:c:b:u:w:s:")) != -1) {
+		switch(o) {
+		case 'n': ncol = atoi(optarg); break;
+		case 'd': days = atof(optarg); break;
+		case 'c': cmdgap = atof(optarg); break;
+		case 'b': bucket = atof(optarg); break;
+		case 'u': uwrap = atof(optarg); break;
+		case 'w': mwrap = atof(optarg); break;
+		case 's': rs = strtoull(optarg, 0, 0) | 1; break;
+		default: usage();
+		}
+	}
+	if(optind != argc || ncol < 1 || ncol > COLLARS || days <= 0
+	|| cmdgap <= 0 || bucket <= 0)
+		usage();
+	end  = (unsigned long long)(days * 86400e6);
+	blen = (unsigned long long)(bucket * 3600e6);
+	if(mwrap < 0) mwrap = days * 12;
+
+	// Collars share the radio, each on its own key
+	//
+	host_reset();
+	host_watch(watch);
+	radio.begin(TX_PIN);
+	for(i = 0; i < ncol; i++) {
+		col[i].c.begin(radio);
+		col[i].c.key = 0x1234 + i;
+		col[i].c.kchan = 1 + i % 3;
+		col[i].next = expo(cmdgap * 60e6);
+	}
+	host_wrap((unsigned long)(uwrap * 60e6),
+		  (unsigned long)(mwrap * 3600e3));
+	us = micros();
+	ms = millis();
+
+	printf("   time    ");
+	for(i = 0; i < ncol; i++)
+		printf("  collar %-2d    ", i + 1);
+	printf("\n           ");
+	for(i = 0; i < ncol; i++)
+		printf("   pkts   air");
+	printf("\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	bend = blen;
+	for(;;) {
+		now = host_time();
+		if(micros() < us) uw = 1;		// Wrapped round
+		if(millis() < ms) mw = 1;
+		us = micros();
+		ms = millis();
+		while(now >= bend || now >= end) {	// Timeline
+			t = bend - blen;
+			line(t, (bend < end ? bend : end) - t, uw, mw);
+			uw = mw = 0;
+			if(bend >= end) break;
+			bend += blen;
+		}
+		if(now >= end) break;
+
+		// Start commands that are due, and keep the rest alive
+		//
+		for(i = 0; i < ncol; i++)
+			if(col[i].next <= now) command(i);
+		for(i = 0; i < ncol; i++)
+			if(!col[i].c.keepalive_due()) run(i, 1);
+
+		// Send the next packet for a running command, taking turns
+		//
+		busy = 0;
+		for(o = 0; o < ncol && !busy; o++) {
+			i = (rr + o) % ncol;
+			if(col[i].c.state() == COLLAR_RUNNING) {
+				run(i, 0);
+				rr = i + 1;
+				busy = 1;
+			}
+		}
+		if(busy) continue;
+
+		// Nothing running: on to the next thing
+		//
+		now = host_time();
+		next = bend < end ? bend : end;
+		for(i = 0; i < ncol; i++) {
+			if(col[i].next < next) next = col[i].next;
+			d = col[i].c.keepalive_due();
+			if(d != ~0UL && now + d * 1000ULL < next)
+				next = now + d * 1000ULL;
+		}
+		if(next > now) host_advance(next - now);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	printf("\ncollar key    chan cmds  kas   pkts     air    "
+	       "duty  maxgap late early\n");
+	for(i = 0; i < ncol; i++) {
+		printf("%6d 0x%04x %4d %4lu %4lu %6lu %6.1fs %6.3f%% %6.1fs "
+		       "%4lu %5lu\n", i + 1, col[i].c.key, col[i].c.kchan,
+		       col[i].cmds, col[i].kas, col[i].pkts,
+		       col[i].air / 1e6, 100.0 * col[i].air / end,
+		       col[i].maxgap / 1e6, col[i].late, col[i].early);
+		if(col[i].late || col[i].early) bad = 1;
+	}
+	printf("\n%.1f days in %.0fms\n", days,
+	       (b.tv_sec - a.tv_sec) * 1e3 + (b.tv_nsec - a.tv_nsec) / 1e6);
+	return bad;
+}
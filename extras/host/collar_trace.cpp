@@ -0,0 +1,90 @@
+// Shock collar driver, loopback trace
+//
+// Sends a command through the host backend, looped back into a receiver,
+// and writes every change of the radio, LED and receiver pins to a VCD
+// file, to see the timing the driver actually produces (lead-in, packets
+// and IPGs) in GTKWave et c.
+//	-c cmd	led, beep, vib or zap (beep)
+//	-p n	power (50)
+//	-n n	packets (3)
+//	-l n	lead-in flags (as the driver's default)
+//	file	VCD file (collar.vcd)
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ShockCollar.h"
+
+#define TX_PIN		5		// Radio data pin
+#define LED_PIN		13		// Activity LED
+#define RX_PIN		7		// Receiver data pin
+
+static ShockCollarRemote remote;
+
+static void loop(char pin, char level, unsigned long t) {
+	if(pin != TX_PIN) return;
+	host_input(RX_PIN, level);
+	remote.receive();
+}
+
+static void usage() {
+	fprintf(stderr, "usage: collar_trace [-c led|beep|vib|zap] [-p power] "
+			"[-n packets]\n\t\t    [-l flags] [file]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	static const char *names[] = { "led", "beep", "vib", "zap" };
+	static const char *events[] = { "", "press", "hold", "release" };
+	const char *file = "collar.vcd";
+	collar_cmd cmd = COLLAR_BEEP;
+	int o, i, pwr = 50, n = 3, lead = -1;
+	ShockCollar collar;
+	collar_msg m;
+
+	while((o = getopt(argc, argv, "c:p:n:l:")) != -1) {
+		switch(o) {
+		case 'c':
+			for(i = 0; i < 4 && strcmp(optarg, names[i]); i++)
+				;
+			if(i == 4) usage();
+			cmd = (collar_cmd)(COLLAR_LED + i);
+			break;
+		case 'p': pwr = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		case 'l': lead = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if(optind < argc) file = argv[optind++];
+	if(optind != argc || n < 1) usage();
+
+	host_reset();
+	host_watch(loop);
+	if(!host_vcd(file)) {
+		perror(file);
+		return 1;
+	}
+	collar.begin(TX_PIN, LED_PIN);
+	if(lead >= 0) collar.leadin(lead, 0);
+	remote.begin(RX_PIN);
+	remote.rxmode(COLLAR_RX_PIN);
+	host_advance(10000);
+	if(!collar.command(cmd, 1, pwr, -n)) usage();
+	host_advance(remote.release + 10000);
+	remote.available();
+	host_vcd_close();
+
+	while(remote.pop(m))
+		printf("%8luus %-7s key %04x chan %d %s power %d\n", m.t,
+		       events[(int)m.event], m.key, m.chan,
+		       names[m.command - COLLAR_LED], m.power);
+	printf("%s: %lu us\n", file, micros());
+	return 0;
+}
@@ -0,0 +1,91 @@
+// Shock collar driver, host backend: VCD traces
+//
+// collar_trace() for the host build (see ShockCollar.h). Changes are kept
+// until host_vcd_close(), then sorted (the receiver's arrive late, when
+// receive() gets to them) and written out as a Value Change Dump, with
+// host_time() timestamps, for GTKWave et c.
+//
+// (C) 2019-2023 Ruru, ruru67@yahoo.com
+//
+// Non-commercial personal use and modification of this work is permitted.
+// Do not distribute this or derived work without permission.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ShockCollar.h"
+
+struct vcd_change {			// Change:
+	unsigned long long t;		//   Time (us since host_reset())
+	unsigned int n;			//   Order logged
+	unsigned char sig;		//   Signal (COLLAR_TRACE_xx | pin)
+	char level;			//   New level
+};
+
+static FILE *vcd;			// File, 0 if not tracing
+static vcd_change *vc;			// Changes so far
+static unsigned int nvc, svc;		//   number & room
+
+int host_vcd(const char *file) {
+	host_vcd_close();
+	if(!(vcd = fopen(file, "w"))) return 0;
+	return 1;
+}
+
+// Log a change. t is a micros() time, maybe a while ago, so work out the
+// host_time() it was.
+//
+void collar_trace(unsigned char sig, char level, unsigned long t) {
+	if(!vcd) return;
+	if(nvc == svc) {
+		svc = svc ? svc * 2 : 4096;
+		vc = (vcd_change *)realloc(vc, svc * sizeof(vcd_change));
+	}
+	vc[nvc].t = host_time() - (unsigned long)(micros() - t);
+	vc[nvc].n = nvc;
+	vc[nvc].sig = sig;
+	vc[nvc].level = level != 0;
+	nvc++;
+}
+
+static int order(const void *a, const void *b) {
+	const vcd_change *x = (const vcd_change *)a, *y = (const vcd_change *)b;
+
+	if(x->t != y->t) return x->t < y->t ? -1 : 1;
+	return x->n < y->n ? -1 : x->n > y->n;
+}
+
+// Write the file. Signals are called tx5, led13, rx7 and so on.
+//
+void host_vcd_close() {
+	static const char *kind[] = { "tx", "led", "rx", "?" };
+	char seen[256];
+	unsigned long long t = 0;
+	unsigned int i;
+	int s, id[256], n = 0;
+
+	if(!vcd) return;
+	qsort(vc, nvc, sizeof(vcd_change), order);
+	memset(seen, 0, sizeof(seen));
+	for(i = 0; i < nvc; i++)
+		seen[vc[i].sig] = 1;
+
+	fprintf(vcd, "$timescale 1us $end\n$scope module collar $end\n");
+	for(s = 0; s < 256; s++)
+		if(seen[s]) {
+			id[s] = n++;
+			fprintf(vcd, "$var wire 1 %c %s%d $end\n", '!' + id[s],
+				kind[s >> 6], s & 0x3f);
+		}
+	fprintf(vcd, "$upscope $end\n$enddefinitions $end\n");
+	for(i = 0; i < nvc; i++) {
+		if(!i || vc[i].t != t)
+			fprintf(vcd, "#%llu\n", t = vc[i].t);
+		fprintf(vcd, "%d%c\n", vc[i].level, '!' + id[vc[i].sig]);
+	}
+	fclose(vcd);
+	vcd = 0;
+	free(vc);
+	vc = 0;
+	nvc = svc = 0;
+}